@@ -6,6 +6,7 @@ KERNEL_DEV_PATH="/dev/ddriver"
 
 USER_DDRIVER="./user_ddriver"
 USER_LOG_PATH="$HOME/ddriver_log"
+USER_STAT_PATH="$HOME/ddriver_stat"
 USER_DEV_PATH="$HOME/ddriver"
 
 
@@ -18,8 +19,10 @@ fi
 
 cd "$WORK_DIR" || exit
 
-CONFIG_BLOCK_SZ=512
-BLOCK_COUNT=8192
+# 磁盘几何可由环境变量覆盖, 如 DDRIVER_DISK_SZ=64G DDRIVER_IO_SZ=4K, 需与驱动配置一致
+DISK_SZ=$(numfmt --from=iec "${DDRIVER_DISK_SZ:-4M}")
+CONFIG_BLOCK_SZ=$(numfmt --from=iec "${DDRIVER_IO_SZ:-512}")
+BLOCK_COUNT=$((DISK_SZ / CONFIG_BLOCK_SZ))
 
 
 function usage(){
@@ -39,6 +42,7 @@ function usage(){
     echo "-d            导出ddriver至当前工作目录[PWD]"
     echo "-r            擦除ddriver"
     echo "-l            显示ddriver的Log"
+    echo "-s            显示ddriver的扩展统计[字节数 / 顺序随机 / 延迟直方图 / 热度图]"
     echo "-v            显示ddriver的类型[内核模块 / 用户静态链接库]"
     echo "-h            打印本帮助菜单"
     echo "===================================================================="
@@ -80,7 +84,7 @@ function install() {
         sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko disk_size="$DISK_SZ" io_size="$CONFIG_BLOCK_SZ"
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
@@ -141,6 +145,18 @@ function log() {
     fi
 }
 
+function show_stat() {
+    STAT_TOOL="$WORK_DIR/$USER_DDRIVER/bin/ddriver_stat"
+    if [ ! -x "$STAT_TOOL" ]; then
+        make -s -C "$WORK_DIR/$USER_DDRIVER" tools || exit
+    fi
+    if [ "$DDRIVER_TYPE" == "k" ]; then  
+        "$STAT_TOOL" -k
+    else 
+        "$STAT_TOOL" "$USER_STAT_PATH"
+    fi
+}
+
 function dump(){
     rm "$ORIGIN_WORK_DIR"/ddriver_dump>/dev/null 2>&1 
     if [ "$DDRIVER_TYPE" == "k" ]; then  
@@ -160,6 +176,9 @@ function clean(){
     else
         echo "目标设备 $USER_DEV_PATH"
         dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        for MEMBER in "$USER_DEV_PATH".[0-9]*; do     # 条带成员，下次打开时重新扩展为全零
+            [ -f "$MEMBER" ] && : >"$MEMBER"
+        done
     fi 
 }
 
@@ -174,7 +193,7 @@ function version () {
 if [ $# == 0 ]; then
     usage
 else 
-    while getopts 'i:tdhrlv' OPT; do
+    while getopts 'i:tdhrlsv' OPT; do
         case $OPT in
             i) install "$OPTARG"
             ;;
@@ -186,6 +205,8 @@ else
             ;;
             l) log
             ;;
+            s) show_stat
+            ;;
             v) version 
             ;;
             h) usage
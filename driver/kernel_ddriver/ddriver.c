@@ -4,6 +4,14 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
 #include "ddriver_ctl.h"
 /******************************************************************************
 * SECTION: Macro definitions
@@ -27,19 +35,17 @@
                         "filp_open/cpp-filp_open-function-examples.html>"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)             /* Defaults, see module params */
 #define CONFIG_BLOCK_SZ (512)
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(addr)     (((addr) & (disk.iounit_size - 1)) == 0)
+#define ADDR_ROUND_UP(addr)     ((addr) & ~((loff_t)disk.iounit_size - 1))
 
-#define GET_HEAD_POS(disk)      (disk.head - disk.layout)
-#define FORWARD_HEAD(disk, dis) (disk.head += dis)
-#define SET_HEAD(disk, ofs)     (disk.head = disk.layout + ofs)
-#define RESET_HEAD(disk)        (SET_HEAD(disk, 0))
+#define DISK_LOCK(disk)         (mutex_lock(&disk.lock))
+#define DISK_UNLOCK(disk)       (mutex_unlock(&disk.lock))
 
 #define INC_READCNT(disk)       (disk.read_cnt++)
 #define INC_WRITECNT(disk)      (disk.write_cnt++)
@@ -51,24 +57,35 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static char *disk_size = "4M";
+module_param(disk_size, charp, 0444);
+MODULE_PARM_DESC(disk_size, "Disk capacity, K/M/G suffix allowed (default 4M)");
+
+static int io_size = CONFIG_BLOCK_SZ;
+module_param(io_size, int, 0444);
+MODULE_PARM_DESC(io_size, "IO unit in bytes, power of two >= 512 (default 512)");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
-    char *head;                                       /* Disk Head */
+    char *layout;                                     /* Disk Layout, vmalloc_user'd for mmap */
     int  read_cnt;
     int  write_cnt;
     int  seek_cnt;
     int  major_num;
     int  open_count;
-    int  layout_size;
+    unsigned long long layout_size;
     int  iounit_size;
+    loff_t last_end;                                  /* End of last transfer */
+    struct ddriver_xstate xstat;
+    struct mutex lock;                                /* Protects counters and stats, 
+                                                         each opener has its own f_pos */
 };
 
 static struct ddriver disk = {
-    .head        = NULL,
+    .layout      = NULL,
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
@@ -80,35 +97,86 @@ static struct ddriver disk = {
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
-        kernel_alert("disk head reach the end");
+/**
+ * @brief Validate a transfer and clip it to the end of disk
+ * 
+ * @param pos           Must be aligned to io unit
+ * @param size          Must be a non-zero multiple of io unit
+ * @return ssize_t      Bytes to transfer, 0 at end of disk, or -errno
+ */
+static ssize_t check_valid(loff_t pos, size_t size){
+    if (size == 0 || !IS_ADDR_ALIGN(size)){
+        kernel_alert("io size %zu should align to %d", size, disk.iounit_size);
+        return -EIO;
+    }
+    if (pos < 0 || !IS_ADDR_ALIGN(pos)) {
+        kernel_alert("offset %lld must be aligned to block size %d", 
+                      pos, disk.iounit_size);
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
-        return -EIO;
+    if (pos >= disk.layout_size)
+        return 0;
+    return min_t(u64, size, disk.layout_size - pos);
+}
+/**
+ * @brief Account one transfer into the extended statistics
+ * 
+ * @param is_write      Write or read
+ * @param pos           Disk offset of the transfer
+ * @param size          Bytes transferred
+ * @param ns            Service time in nanoseconds
+ */
+static void stat_account(int is_write, loff_t pos, size_t size, u64 ns) {
+    struct ddriver_xstate *x = &disk.xstat;
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    int b = us > 1 ? min_t(int, ilog2(us), DDRIVER_HIST_BUCKETS - 1) : 0;
+    u64 r;
+
+    if (is_write) {
+        x->write_bytes += size;
+        x->write_hist[b]++;
     }
-    return 0;
+    else {
+        x->read_bytes += size;
+        x->read_hist[b]++;
+    }
+    if (pos == disk.last_end) {
+        x->seq_cnt++;
+    }
+    else {
+        x->rand_cnt++;
+        x->seek_dist += abs(pos - disk.last_end);
+    }
+    disk.last_end = pos + size;
+
+    for (r = div64_u64(pos, x->region_size); 
+         r <= div64_u64(pos + size - 1, x->region_size) && r < DDRIVER_HEAT_REGIONS; r++)
+        x->heatmap[r]++;
 }
 /******************************************************************************
 * SECTION: Function definitions
 *******************************************************************************/
 static int      device_open(struct inode *, struct file *);
 static int      device_release(struct inode *, struct file *);
-static ssize_t  device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t  device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  device_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t  device_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t  device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  device_write_iter(struct kiocb *, struct iov_iter *);
 static loff_t   device_seek(struct file *, loff_t, int);
 static long     device_ioctl(struct file *, unsigned int, unsigned long);
+static int      device_mmap(struct file *, struct vm_area_struct *);
 /******************************************************************************
 * SECTION: Global var or structure definitions
 *******************************************************************************/
 static struct file_operations file_ops = {
     .read = device_read,
     .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .llseek = device_seek,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
     .release = device_release
 };
 /******************************************************************************
@@ -119,109 +187,255 @@ static struct file_operations file_ops = {
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
- * @return ssize_t      Bytes have been read 
+ * @param size          Multiple of io unit (module param io_size)
+ * @param offset        File position of this opener, advanced by the bytes read
+ * @return ssize_t      Bytes have been read, 0 at end of disk
  */
 static ssize_t 
-device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
+device_read(struct file *file, char __user *user_buffer, size_t size, loff_t *offset) {
+    loff_t pos = *offset;
+    ssize_t len = check_valid(pos, size);
+    u64 start;
     IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
+    if (len <= 0)
+        return len;
+
+    DISK_LOCK(disk);
+    start = ktime_get_ns();
+    if (copy_to_user(user_buffer, disk.layout + pos, len)) {
+        DISK_UNLOCK(disk);
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+    }
+    stat_account(0, pos, len, ktime_get_ns() - start);
     INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    DISK_UNLOCK(disk);
+    *offset = pos + len;
+    return len;
 }
 /**
  * @brief Disk Write
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param size          Multiple of io unit (module param io_size)
+ * @param offset        File position of this opener, advanced by the bytes written
  * @return ssize_t      Bytes have been written
  */
 static ssize_t 
-device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
+device_write(struct file *file, const char __user *user_buffer, size_t size, loff_t *offset) {
+    loff_t pos = *offset;
+    ssize_t len = check_valid(pos, size);
+    u64 start;
     IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
+    if (len <= 0)
+        return len ? len : -ENOSPC;
 
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
+    DISK_LOCK(disk);
+    start = ktime_get_ns();
+    if (copy_from_user(disk.layout + pos, user_buffer, len)) {
+        DISK_UNLOCK(disk);
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+    }
+    stat_account(1, pos, len, ktime_get_ns() - start);
     INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    DISK_UNLOCK(disk);
+    *offset = pos + len;
+    return len;
 }
 /**
- * @brief Disk Seek
+ * @brief Vectored Disk Read, serves readv/preadv in one call
  * 
- * @param file          Ignored
- * @param offset        Aligned to @CONFIG_BLOCK_SZ
- * @param whence        SEEK_CUR, SEEK_SET
+ * @param iocb          Position in ki_pos
+ * @param to            Destination, total length multiple of io unit
+ * @return ssize_t      Bytes have been read, 0 at end of disk
+ */
+static ssize_t 
+device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    loff_t pos = iocb->ki_pos;
+    ssize_t len = check_valid(pos, iov_iter_count(to));
+    u64 start;
+    if (len <= 0)
+        return len;
+
+    DISK_LOCK(disk);
+    start = ktime_get_ns();
+    if (copy_to_iter(disk.layout + pos, len, to) != len) {
+        DISK_UNLOCK(disk);
+        return -EFAULT;
+    }
+    stat_account(0, pos, len, ktime_get_ns() - start);
+    INC_READCNT(disk);
+    DISK_UNLOCK(disk);
+    iocb->ki_pos = pos + len;
+    return len;
+}
+/**
+ * @brief Vectored Disk Write, serves writev/pwritev in one call
+ * 
+ * @param iocb          Position in ki_pos
+ * @param from          Source, total length multiple of io unit
+ * @return ssize_t      Bytes have been written
+ */
+static ssize_t 
+device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    loff_t pos = iocb->ki_pos;
+    ssize_t len = check_valid(pos, iov_iter_count(from));
+    u64 start;
+    if (len <= 0)
+        return len ? len : -ENOSPC;
+
+    DISK_LOCK(disk);
+    start = ktime_get_ns();
+    if (copy_from_iter(disk.layout + pos, len, from) != len) {
+        DISK_UNLOCK(disk);
+        return -EFAULT;
+    }
+    stat_account(1, pos, len, ktime_get_ns() - start);
+    INC_WRITECNT(disk);
+    DISK_UNLOCK(disk);
+    iocb->ki_pos = pos + len;
+    return len;
+}
+/**
+ * @brief Disk Seek, moves the file position of this opener only
+ * 
+ * @param file          Opener whose f_pos is moved
+ * @param offset        Resulting position must be aligned to io unit
+ * @param whence        SEEK_SET, SEEK_CUR, SEEK_END
  * @return loff_t       cur pos
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
-    IGNORE_ARG(file);
-    if (!IS_ADDR_ALIGN(offset)) {
-        kernel_alert("offset %lld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
-        return -EINVAL;
-    }
+    loff_t pos;
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = file->f_pos + offset;
         break;
-    default:
+    case SEEK_END:
+        pos = disk.layout_size + offset;
         break;
+    default:
+        return -EINVAL;
+    }
+    if (pos < 0 || pos > disk.layout_size || !IS_ADDR_ALIGN(pos)) {
+        kernel_alert("offset %lld must be aligned to block size %d", 
+                      pos, disk.iounit_size);
+        return -EINVAL;
     }
+    file->f_pos = pos;
+    DISK_LOCK(disk);
     INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    DISK_UNLOCK(disk);
+    return pos;
 }
 /**
- * @brief Disk ioctl
+ * @brief Disk mmap, maps the layout pages directly so reads and writes need no syscall.
+ *        Mapped accesses are invisible to the driver, report them with IOC_REQ_DEVICE_MAP_IO
  * 
  * @param file          Ignored
+ * @param vma           Offset and length must stay inside the disk
+ * @return int          state
+ */
+static int 
+device_mmap(struct file *file, struct vm_area_struct *vma) {
+    IGNORE_ARG(file);
+    return remap_vmalloc_range(vma, disk.layout, vma->vm_pgoff);
+}
+/**
+ * @brief Disk ioctl
+ * 
+ * @param file          RESET rewinds this opener
  * @param cmd           Command
  * @param arg           Args
  * @return long         State
  */
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    IGNORE_ARG(file);
     int ret;
+    int size;
+    u64 region;
     struct ddriver_state state;
+    struct ddriver_map_io map_io;
+    struct ddriver_discard discard;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        ret = copy_to_user((int __user *)arg, &disk.layout_size, sizeof(int));
+        if (disk.layout_size > INT_MAX)               /* Use IOC_REQ_DEVICE_SIZE64 */
+            return -EOVERFLOW;
+        size = disk.layout_size;
+        ret = copy_to_user((int __user *)arg, &size, sizeof(int));
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_SIZE64:
+        ret = copy_to_user((unsigned long long __user *)arg, &disk.layout_size, 
+                           sizeof(unsigned long long));
         if (ret) 
             return -EFAULT;
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
+        DISK_LOCK(disk);
         state.read_cnt = disk.read_cnt;
         state.write_cnt = disk.write_cnt;
         state.seek_cnt = disk.seek_cnt;
+        DISK_UNLOCK(disk);
         ret = copy_to_user((int __user *)arg, &state, sizeof(struct ddriver_state));
         if (ret) 
             return -EFAULT;
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        disk.head = disk.layout;
+        DISK_LOCK(disk);
+        file->f_pos = 0;
         disk.read_cnt = 0;
         disk.write_cnt = 0;
         disk.seek_cnt = 0;
+        disk.last_end = 0;
+        region = disk.xstat.region_size;
+        memset(&disk.xstat, 0, sizeof(disk.xstat));
+        disk.xstat.region_size = region;
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_XSTATE:                       /* Extended statistics */
+        DISK_LOCK(disk);
+        ret = copy_to_user((struct ddriver_xstate __user *)arg, &disk.xstat, 
+                           sizeof(struct ddriver_xstate));
+        DISK_UNLOCK(disk);
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_MAP_IO:                       /* Account a mapped access */
+        if (copy_from_user(&map_io, (struct ddriver_map_io __user *)arg, sizeof(map_io)))
+            return -EFAULT;
+        if (map_io.size == 0 || map_io.offset >= disk.layout_size || 
+            map_io.size > disk.layout_size - map_io.offset)
+            return -EINVAL;
+        DISK_LOCK(disk);
+        stat_account(map_io.is_write, map_io.offset, map_io.size, 0);
+        if (map_io.is_write)
+            INC_WRITECNT(disk);
+        else
+            INC_READCNT(disk);
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* TRIM a range, reads back zero */
+        if (copy_from_user(&discard, (struct ddriver_discard __user *)arg, sizeof(discard)))
+            return -EFAULT;
+        if (discard.size == 0 || !IS_ADDR_ALIGN(discard.offset) || !IS_ADDR_ALIGN(discard.size) ||
+            discard.offset >= disk.layout_size || discard.size > disk.layout_size - discard.offset)
+            return -EINVAL;
+        DISK_LOCK(disk);                              /* vmalloc pages stay, just zero them */
+        memset(disk.layout + discard.offset, 0, discard.size);
+        disk.xstat.discard_bytes += discard.size;
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* No volatile cache, writes land in place */
+        DISK_LOCK(disk);
+        disk.xstat.flush_cnt++;
+        DISK_UNLOCK(disk);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
@@ -243,13 +457,11 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
 static int 
 device_open(struct inode *inode, struct file *file) {
     IGNORE_ARG(inode);
-    IGNORE_ARG(file);
     
-    if (disk.open_count) {                            /* If device is open, return busy */
-        return -EBUSY;
-    }
-    RESET_HEAD(disk);                                 /* Everytime close device, reset head */
+    DISK_LOCK(disk);                                  /* Openers share the disk, each with its own head */
     disk.open_count++;
+    DISK_UNLOCK(disk);
+    file->f_pos = 0;
     try_module_get(THIS_MODULE);
     return 0;
 }
@@ -266,7 +478,9 @@ device_release(struct inode *inode, struct file *file) {
                                                          Without this, the module would not unload. */
     IGNORE_ARG(inode);
     IGNORE_ARG(file);
+    DISK_LOCK(disk);
     disk.open_count--;
+    DISK_UNLOCK(disk);
     module_put(THIS_MODULE);
     return 0;
 }
@@ -276,16 +490,36 @@ device_release(struct inode *inode, struct file *file) {
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int major_num;
+
+    mutex_init(&disk.lock);
+    disk.layout_size = memparse(disk_size, NULL);
+    disk.iounit_size = io_size;
+    if (io_size < CONFIG_BLOCK_SZ || !is_power_of_2(io_size) ||
+        disk.layout_size < io_size || (disk.layout_size & (io_size - 1))) {
+        kernel_alert("bad geometry: disk_size=%s io_size=%d", disk_size, io_size);
+        return -EINVAL;
+    }
+    disk.xstat.region_size = div_u64(disk.layout_size + DDRIVER_HEAT_REGIONS - 1, 
+                                     DDRIVER_HEAT_REGIONS);
+    disk.layout = vmalloc_user(disk.layout_size);     /* Zeroed and remappable to user space */
+    if (disk.layout == NULL) {
+        kernel_alert("Can't allocate %llu bytes of disk", disk.layout_size);
+        return -ENOMEM;
+    }
+
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
+        vfree(disk.layout);
+        disk.layout = NULL;
         return major_num;
     } 
     else {                                            /* Register success */                                                  
+        kernel_info("disk of %llu bytes, io unit %d", disk.layout_size, disk.iounit_size);
         kernel_info("module loaded with device major number %d", major_num);
         disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
         return 0;
     }
     return 0;
@@ -299,6 +533,8 @@ ddriver_exit(void)
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    vfree(disk.layout);
+    disk.layout = NULL;
 }
 
 module_init(ddriver_init);
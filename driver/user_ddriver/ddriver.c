@@ -1,15 +1,29 @@
+#define _GNU_SOURCE                                  /* fallocate */
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include "string.h"
 #include <linux/fs.h>
 #include "ddriver_ctl.h"
+#include "ddriver.h"
+#include "ddriver_trace.h"
 #include "stdio.h"
 #include "errno.h"
 #include <pwd.h>
 #include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DDRIVER_HAVE_URING
+#endif
+#endif
 
 extern int errno;
 
@@ -22,19 +36,29 @@ extern int errno;
 *******************************************************************************/   
 #define DEVICE_NAME   "ddriver"
 #define DEVICE_LOG    "ddriver_log"
+#define DEVICE_CONF   "ddriver.conf"
+#define DEVICE_STAT   "ddriver_stat"
 
-#define user_info(fmt, ...)\
-	do {\
-		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
+/* 日志级别，编译时以make LOG_LEVEL=...选择，高于该级别的user_info/user_alert不会编译进来 */
+#define DDRIVER_LOG_PANIC   0
+#define DDRIVER_LOG_ALERT   1
+#define DDRIVER_LOG_INFO    2
+#ifndef DDRIVER_LOG_LEVEL
+#define DDRIVER_LOG_LEVEL   DDRIVER_LOG_INFO
+#endif
 
-#define user_alert(fmt, ...)\
+#define user_log(level, tag, fmt, ...)\
 	do {\
-		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+		if (level <= DDRIVER_LOG_LEVEL) {\
+			printf(tag DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
+			if (debugf != NULL)\
+				fprintf(debugf, tag " " fmt "\n", ##__VA_ARGS__);\
+		}\
 	} while(0)\
 
+#define user_info(fmt, ...)  user_log(DDRIVER_LOG_INFO, USER_INFO, fmt, ##__VA_ARGS__)
+#define user_alert(fmt, ...) user_log(DDRIVER_LOG_ALERT, USER_ALERT, fmt, ##__VA_ARGS__)
+
 #define user_panic(fmt, ...)\
     do {\
         printf(USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
@@ -44,20 +68,45 @@ extern int errno;
 #define DRIVER_DESC     "A Fake disk driver in user space"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)        /* Defaults, see load_geometry */
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_TRACK_NUM (100)
+#define CONFIG_IOV_MAX  (1024)                   /* Same as UIO_MAXIOV */
+#define CONFIG_AIO_DEPTH    (64)                 /* Max in-flight async requests */
+#define CONFIG_AIO_WORKERS  (2)                  /* Fallback worker threads */
+#define CONFIG_URING_STALLS (64)                 /* Fruitless io_uring_enter calls before failing */
+#define CONFIG_READ_EXPIRE  (50 * NS_PER_MS)     /* Deadline policy, simulated time */
+#define CONFIG_WRITE_EXPIRE (250 * NS_PER_MS)
+#define CONFIG_WCACHE_SZ    (0)                  /* Write cache off unless configured */
+#define CONFIG_STRIPES      (1)                  /* Backing images, > 1 stripes the disk */
+#define CONFIG_STRIPE_UNIT  (64 * 1024)
+#define CONFIG_MAX_STRIPES  (16)
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(addr)     ((addr) % disk.iounit_size == 0)
+#define ADDR_ROUND_UP(addr)     (((addr) / disk.iounit_size) * disk.iounit_size)
 
 #define INC_READCNT(disk)       (disk.read_cnt++)
 #define INC_WRITECNT(disk)      (disk.write_cnt++)
 #define INC_SEEKCNT(disk)       (disk.seek_cnt++)
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
+#define NS_PER_MS               (1000000LL)
+#define NS_PER_US               (1000LL)
+#define XFER_LAT(disk, sz)      ((sz) / disk.iounit_size * disk.xfer_lat * NS_PER_US)
+#define RW_LAT(disk, rw_ops, sz) (disk.rw_ops##_lat * NS_PER_MS + XFER_LAT(disk, sz))
+#define RW_DELAY(disk, rw_ops)  (emulate_delay(emulate_charge(RW_LAT(disk, rw_ops, disk.iounit_size))))
+
+#define DISK_LOCK(disk)         (pthread_mutex_lock(&disk.lock))
+#define DISK_UNLOCK(disk)       (pthread_mutex_unlock(&disk.lock))
+#define AIO_LOCK(aio)           (pthread_mutex_lock(&aio.lock))
+#define AIO_UNLOCK(aio)         (pthread_mutex_unlock(&aio.lock))
+
+#define MEMBER_SZ               (disk.layout_size / disk.stripes)
+
+#define WCACHE_HASH(off)        ((int)(((off) / disk.iounit_size) % wcache.nlines))
+#define WCACHE_DATA(idx)        (wcache.data + (size_t)(idx) * disk.iounit_size)
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
@@ -70,10 +119,104 @@ struct ddriver
     int  read_lat;
     int  write_lat;
     int  seek_lat;
+    int  xfer_lat;
     int  track_num;
     int  major_num;
-    int  layout_size;
+    long long layout_size;
     int  iounit_size;
+    int  stripes;                                    /* Backing images */
+    int  stripe_unit;                                /* Bytes per member before moving on */
+    int  backend;                                    /* DDRIVER_BACKEND_* */
+    char *map;                                       /* Mapped image (mmap backend) */
+    int  vclock;                                     /* Virtual clock, never sleep */
+    unsigned long long sim_ns;                       /* Simulated device time */
+    off_t head;                                      /* Emulated disk head, logical if striped */
+    off_t last_end;                                  /* End of last transfer */
+    struct ddriver_xstate xstat;
+    pthread_mutex_t lock;                            /* Protects head and counters */
+};
+struct ddriver_member
+{
+    int   fd;
+    char  *map;                                      /* Mapped image (mmap backend) */
+    off_t head;                                      /* Own head when striped */
+    unsigned long long busy_ns;                      /* Simulated service time */
+    pthread_mutex_t lock;                            /* One request on the platter at a time */
+};
+
+enum aio_state {
+    AIO_FREE = 0,
+    AIO_PENDING,                                     /* Waiting for a worker */
+    AIO_INFLIGHT,
+    AIO_DONE                                         /* Waiting to be polled */
+};
+
+struct aio_req
+{
+    int     state;
+    int     is_write;
+    char    *buf;
+    size_t  size;
+    off_t   offset;
+    void    *priv;
+    ssize_t res;
+    long long delay;                                 /* Latency owed at reap (ns) */
+    unsigned long seq;                               /* Submit order, then done order */
+    unsigned long long stamp;                        /* Simulated time at submit */
+};
+
+struct sched_policy
+{
+    const char *name;
+    int (*pick)(off_t head);                         /* Next PENDING slot, -1 if none */
+    int plug;                                        /* Hold requests until polled */
+};
+
+enum wcache_policy {
+    WCACHE_LRU = 0,                                  /* Destage the least recently written sector */
+    WCACHE_FIFO,                                     /* Destage the oldest cached sector */
+    WCACHE_BATCH                                     /* Destage the whole cache, sorted */
+};
+
+struct wcache_line
+{
+    off_t offset;                                    /* -1 when free */
+    unsigned long stamp;                             /* Last write (LRU) or insertion */
+    int   next;                                      /* Hash chain or free list */
+};
+
+struct ddriver_wcache
+{
+    long long size;                                  /* Configured bytes, 0 disables */
+    int  nlines;                                     /* IO units held, 0 when disabled */
+    int  used;
+    int  policy;                                     /* WCACHE_* */
+    int  free;                                       /* Free list head */
+    unsigned long clock;
+    struct wcache_line *lines;
+    int  *buckets;                                   /* nlines hash chains by offset */
+    int  *order;                                     /* Scratch for sorted destage */
+    char *data;
+};
+
+struct ddriver_aio
+{
+    int  fd;
+    int  started;
+    int  use_uring;
+    int  stop;
+    unsigned long submit_seq;
+    unsigned long done_seq;
+    struct aio_req reqs[CONFIG_AIO_DEPTH];
+    pthread_t workers[CONFIG_AIO_WORKERS];
+    const struct sched_policy *sched;
+    int  unplugged;                                  /* Plugged batch released by poll */
+    int  scan_dir;                                   /* SCAN sweep direction, 1 or -1 */
+    off_t fifo_head;                                 /* Head position under FIFO service */
+    struct ddriver_sched_state stat;
+    pthread_mutex_t lock;
+    pthread_cond_t  submit_cond;
+    pthread_cond_t  done_cond;
 };
 /******************************************************************************
 * SECTION: Global Variable
@@ -86,78 +229,1528 @@ struct ddriver disk = {
     .read_lat    = 2,       /* 2ms */       
     .write_lat   = 1,       /* 1ms */
     .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .xfer_lat    = 5,       /* 5us per IO unit, ~100MB/s */
     .major_num   = 0,
-    .track_num   = 100,
+    .track_num   = CONFIG_TRACK_NUM,
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .stripes     = CONFIG_STRIPES,
+    .stripe_unit = CONFIG_STRIPE_UNIT,
+    .backend     = DDRIVER_BACKEND_FILE,
+    .map         = NULL,
+    .vclock      = 0,
+    .sim_ns      = 0,
+    .head        = 0,
+    .lock        = PTHREAD_MUTEX_INITIALIZER
+};
+
+struct ddriver_member member[CONFIG_MAX_STRIPES] = {
+    [0 ... CONFIG_MAX_STRIPES - 1] = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+struct ddriver_aio aio = {
+    .fd          = -1,
+    .started     = 0,
+    .scan_dir    = 1,
+    .lock        = PTHREAD_MUTEX_INITIALIZER,
+    .submit_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond   = PTHREAD_COND_INITIALIZER
+};
+
+struct ddriver_wcache wcache = {
+    .size        = CONFIG_WCACHE_SZ,
+    .nlines      = 0
 };
 
 FILE *debugf = NULL;
+FILE *tracef = NULL;
+struct timespec trace_t0;
+char stat_path[128] = {0};
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
 int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (size != disk.iounit_size){
+        user_alert("io size %ld should align to %d", size, disk.iounit_size);
         return -EIO;
     }
     return 0;
 }
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
+ssize_t check_valid_vec(const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    int i;
+
+    if (iovcnt <= 0 || iovcnt > CONFIG_IOV_MAX) {
+        user_alert("iovcnt %d out of range (1, %d)", iovcnt, CONFIG_IOV_MAX);
+        return -EINVAL;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0 || !IS_ADDR_ALIGN(iov[i].iov_len)) {
+            user_alert("iov[%d] size %ld should align to %d", 
+                       i, iov[i].iov_len, disk.iounit_size);
+            return -EIO;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * @brief 计算磁头从start转到end的延迟
+ * 
+ * @return long long 延迟(ns)，由调用方决定何时睡眠
+ */
+long long emulate_rotate(int fd, off_t start, off_t end) {
+    long long bytes_per_track = MEMBER_SZ / disk.track_num;
     int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
+    long long distance = llabs(end - start) % bytes_per_track; 
     
     if (distance == 0) {
         return 0;
     }
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    return distance * lat_per_track * NS_PER_MS / bytes_per_track;
+}
+/**
+ * @brief 把延迟计入模拟设备时间，调用方需持有disk.lock
+ */
+long long emulate_charge(long long ns) {
+    disk.sim_ns += ns;
+    return ns;
+}
+/**
+ * @brief 真实时钟下睡眠ns，虚拟时钟下只记账不睡眠
+ */
+void emulate_delay(long long ns) {
+    struct timespec ts;
+    if (disk.vclock || ns <= 0)
+        return;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+/*
+ * 条带化(stripes > 1)时逻辑磁盘按stripe_unit轮流分布在多个后备镜像上：
+ * ~/ddriver为0号成员，其余为~/ddriver.1、~/ddriver.2...，每个成员有自己的磁头与延迟模型。
+ * 一个请求在每个成员上总是一段连续区间，各成员并行服务，延迟取最慢的成员；
+ * 不同请求只要落在不同成员上就可以同时睡眠，聚合带宽随成员数增长。
+ */
+/**
+ * @brief 把逻辑地址映射到条带成员
+ * 
+ * @param moff 成员内偏移
+ * @param len 从offset起落在同一条带单元内的字节数，不超过size
+ * @return int 成员下标
+ */
+static int stripe_map(off_t offset, long long size, off_t *moff, long long *len) {
+    long long unit = disk.stripe_unit;
+    long long stripe = offset / unit;
+
+    if (disk.stripes == 1) {
+        *moff = offset;
+        *len = size;
+        return 0;
+    }
+    *moff = stripe / disk.stripes * unit + offset % unit;
+    *len = unit - offset % unit < size ? unit - offset % unit : size;
+    return stripe % disk.stripes;
+}
+/**
+ * @brief [offset, offset + size)涉及的成员位图
+ */
+static unsigned stripe_mask(off_t offset, long long size) {
+    unsigned mask = 0, all = (1U << disk.stripes) - 1;
+    long long len;
+    off_t moff;
+
+    while (size > 0 && mask != all) {
+        mask |= 1U << stripe_map(offset, size, &moff, &len);
+        offset += len;
+        size -= len;
+    }
+    return mask;
+}
+/**
+ * @brief 按下标顺序锁住mask中的成员，期间这些成员的磁头被占用
+ */
+static void stripe_lock(unsigned mask) {
+    int i;
+    for (i = 0; i < disk.stripes; i++) {
+        if (mask & (1U << i))
+            pthread_mutex_lock(&member[i].lock);
+    }
+}
+
+static void stripe_unlock(unsigned mask) {
+    int i;
+    for (i = 0; i < disk.stripes; i++) {
+        if (mask & (1U << i))
+            pthread_mutex_unlock(&member[i].lock);
+    }
+}
+/**
+ * @brief 单个后备镜像的读写：mmap后端直接memcpy映射区，file后端走preadv/pwritev
+ */
+static ssize_t member_io(struct ddriver_member *m, int is_write, 
+                         const struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t total = 0;
+    int i;
+
+    if (disk.backend != DDRIVER_BACKEND_MMAP) {
+        return is_write ? pwritev(m->fd, iov, iovcnt, offset) 
+                        : preadv(m->fd, iov, iovcnt, offset);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (is_write)
+            memcpy(m->map + offset + total, iov[i].iov_base, iov[i].iov_len);
+        else
+            memcpy(iov[i].iov_base, m->map + offset + total, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+/**
+ * @brief 后备存储读写，条带化时按条带单元拆分到各成员
+ */
+ssize_t backend_io(int fd, int is_write, const struct iovec *iov, int iovcnt, off_t offset) {
+    struct iovec sub[CONFIG_IOV_MAX];
+    ssize_t total = 0, chunk, ret;
+    long long len;
+    size_t skip = 0, take;
+    off_t moff;
+    int i = 0, n, m;
+    IGNORE_ARG(fd);
+
+    if (disk.stripes == 1)
+        return member_io(&member[0], is_write, iov, iovcnt, offset);
+    while (i < iovcnt) {
+        m = stripe_map(offset + total, LLONG_MAX, &moff, &len);
+        for (n = 0, chunk = 0; n < CONFIG_IOV_MAX && len > 0 && i < iovcnt; n++) {
+            take = iov[i].iov_len - skip < (size_t)len ? iov[i].iov_len - skip : (size_t)len;
+            sub[n].iov_base = (char *)iov[i].iov_base + skip;
+            sub[n].iov_len = take;
+            chunk += take;
+            len -= take;
+            skip += take;
+            if (skip == iov[i].iov_len) {
+                i++;
+                skip = 0;
+            }
+        }
+        ret = member_io(&member[m], is_write, sub, n, moff);
+        if (ret != chunk)
+            return ret < 0 ? ret : total + ret;
+        total += chunk;
+    }
+    return total;
+}
+/**
+ * @brief 把全部成员镜像落盘
+ */
+static int stripe_sync(void) {
+    int i, ret = 0;
+    for (i = 0; i < disk.stripes; i++) {
+        if (disk.backend == DDRIVER_BACKEND_MMAP ? msync(member[i].map, MEMBER_SZ, MS_SYNC) 
+                                                 : fsync(member[i].fd))
+            ret = -errno;
+    }
+    return ret;
+}
+int check_valid_range(off_t offset, ssize_t size) {
+    if (!IS_ADDR_ALIGN(offset) || offset < 0 || offset + size > disk.layout_size) {
+        user_alert("io [%ld, %ld) must be aligned to %d and inside disk", 
+                   offset, offset + size, disk.iounit_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 记入扩展统计：字节数、顺序/随机、延迟直方图与区域热度，调用方需持有disk.lock
+ * 
+ * @param delay 该请求承担的模拟延迟(ns)
+ */
+void stat_account(int is_write, off_t offset, ssize_t size, long long delay) {
+    struct ddriver_xstate *x = &disk.xstat;
+    long long us = delay / NS_PER_US;
+    long long r;
+    int b = 0;
+
+    if (is_write)
+        x->write_bytes += size;
+    else
+        x->read_bytes += size;
+    if (offset == disk.last_end)
+        x->seq_cnt++;
+    else
+        x->rand_cnt++;
+    disk.last_end = offset + size;
+
+    while (b < DDRIVER_HIST_BUCKETS - 1 && (us >> (b + 1)) != 0)
+        b++;
+    if (is_write)
+        x->write_hist[b]++;
+    else
+        x->read_hist[b]++;
+
+    for (r = offset / x->region_size; 
+         r <= (offset + size - 1) / x->region_size && r < DDRIVER_HEAT_REGIONS; r++)
+        x->heatmap[r]++;
+}
+/**
+ * @brief 把扩展统计连同基本计数写到~/ddriver_stat，格式为
+ * struct ddriver_state紧跟struct ddriver_xstate，供ddriver_stat工具读取
+ */
+int stat_dump(void) {
+    struct ddriver_state state;
+    FILE *f = fopen(stat_path, "w");
+    int ret;
+
+    if (f == NULL)
+        return -errno;
+    DISK_LOCK(disk);
+    state.read_cnt = disk.read_cnt;
+    state.write_cnt = disk.write_cnt;
+    state.seek_cnt = disk.seek_cnt;
+    ret = fwrite(&state, sizeof(state), 1, f) == 1 &&
+          fwrite(&disk.xstat, sizeof(disk.xstat), 1, f) == 1;
+    DISK_UNLOCK(disk);
+    fclose(f);
+    return ret ? 0 : -EIO;
+}
+/**
+ * @brief 打开DDRIVER_TRACE指定的跟踪文件并写入文件头，未设置时不跟踪
+ */
+int trace_open(void) {
+    struct ddriver_trace_hdr hdr;
+    char *path = getenv("DDRIVER_TRACE");
+
+    if (path == NULL || *path == '\0')
+        return 0;
+    tracef = fopen(path, "w");
+    if (tracef == NULL) {
+        user_panic("can't open trace: %s", path);
+        return -errno;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DDRIVER_TRACE_MAGIC;
+    hdr.version = DDRIVER_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct ddriver_trace_rec);
+    hdr.iounit_size = disk.iounit_size;
+    hdr.track_num = disk.track_num;
+    hdr.layout_size = disk.layout_size;
+    fwrite(&hdr, sizeof(hdr), 1, tracef);
+    clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+    return 0;
+}
+/**
+ * @brief 记一条跟踪记录，单条fwrite由stdio加锁，多线程调用无需另外加锁
+ */
+void trace_record(int op, off_t offset, size_t size) {
+    struct ddriver_trace_rec rec;
+    struct timespec now;
+
+    if (tracef == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = (now.tv_sec - trace_t0.tv_sec) * 1000000000LL + (now.tv_nsec - trace_t0.tv_nsec);
+    rec.offset = offset;
+    rec.size = size;
+    rec.op = op;
+    fwrite(&rec, sizeof(rec), 1, tracef);
+}
+
+void trace_vec(int op, off_t offset, const struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+    int i;
+    if (tracef == NULL)
+        return;
+    for (i = 0; i < iovcnt && i < CONFIG_IOV_MAX; i++)
+        size += iov[i].iov_len;
+    trace_record(op, offset, size);
+}
+/**
+ * @brief 条带化请求的记账：每个成员移动自己的磁头，返回最慢成员的延迟(ns)
+ */
+static long long stripe_account(int fd, int is_write, off_t offset, ssize_t size) {
+    long long bytes[CONFIG_MAX_STRIPES] = {0};
+    off_t start[CONFIG_MAX_STRIPES], pos, moff;
+    long long len, delay, slowest = 0;
+    int m;
+
+    for (pos = offset; pos < offset + size; pos += len) {
+        m = stripe_map(pos, offset + size - pos, &moff, &len);
+        if (bytes[m] == 0)
+            start[m] = moff;
+        bytes[m] += len;
+    }
+    for (m = 0; m < disk.stripes; m++) {
+        if (bytes[m] == 0)
+            continue;
+        delay = 0;
+        if (member[m].head != start[m]) {
+            INC_SEEKCNT(disk);
+            disk.xstat.seek_dist += llabs(start[m] - member[m].head);
+            delay += emulate_rotate(fd, member[m].head, start[m]);
+        }
+        member[m].head = start[m] + bytes[m];
+        delay += is_write ? RW_LAT(disk, write, bytes[m]) : RW_LAT(disk, read, bytes[m]);
+        member[m].busy_ns += delay;
+        slowest = delay > slowest ? delay : slowest;
+    }
+    return slowest;
+}
+/**
+ * @brief 记一次定位式请求：移动模拟磁头、更新计数并计入模拟时间，调用方需持有disk.lock；
+ * 条带化时各成员分别寻道传输，取最慢的成员
+ * 
+ * @return long long 该请求应承担的延迟(ns)，包括寻道、旋转与传输
+ */
+long long emulate_account(int fd, int is_write, off_t offset, ssize_t size) {
+    long long delay = 0;
+
+    if (disk.stripes > 1) {
+        delay = stripe_account(fd, is_write, offset, size);
+    }
+    else if (disk.head != offset) {
+        INC_SEEKCNT(disk);
+        disk.xstat.seek_dist += llabs(offset - disk.head);
+        delay += emulate_rotate(fd, disk.head, offset);
+    }
+    disk.head = offset + size;
+    if (is_write) {
+        INC_WRITECNT(disk);
+        delay += disk.stripes > 1 ? 0 : RW_LAT(disk, write, size);
+    }
+    else {
+        INC_READCNT(disk);
+        delay += disk.stripes > 1 ? 0 : RW_LAT(disk, read, size);
+    }
+    stat_account(is_write, offset, size, delay);
+    return emulate_charge(delay);
+}
+/*
+ * 写缓存模拟真实磁盘的易失性缓存：写入按IO单位放入缓存后即返回，只计传输延迟，
+ * 对同一扇区的反复覆盖(如反复回写的inode表扇区)被缓存吸收而不落盘；
+ * 缓存满时按策略(DDRIVER_WCACHE_POLICY)写回腾出空间，写回按地址排序，相邻扇区合并为一次请求：
+ *   lru:   写回最久未写的扇区(默认)
+ *   fifo:  写回最早进入缓存的扇区
+ *   batch: 一次写回全部缓存
+ * 读请求先查缓存，全部命中时只计传输延迟。IOC_REQ_DEVICE_FLUSH与关闭设备时写回全部缓存，
+ * 缓存中的数据在此之前可能随进程退出而丢失。以下函数的调用方都需持有disk.lock。
+ */
+/**
+ * @brief 按wcache.size分配写缓存，policy取lru|fifo|batch
+ */
+int wcache_init(const char *policy) {
+    int i, n = wcache.size / disk.iounit_size;
+
+    wcache.nlines = 0;
+    if (n == 0)
+        return 0;
+    if (policy == NULL || strcmp(policy, "lru") == 0)
+        wcache.policy = WCACHE_LRU;
+    else if (strcmp(policy, "fifo") == 0)
+        wcache.policy = WCACHE_FIFO;
+    else if (strcmp(policy, "batch") == 0)
+        wcache.policy = WCACHE_BATCH;
+    else {
+        user_panic("unknown write cache policy [%s], using lru", policy);
+        wcache.policy = WCACHE_LRU;
+    }
+    wcache.lines = calloc(n, sizeof(struct wcache_line));
+    wcache.buckets = calloc(n, sizeof(int));
+    wcache.order = calloc(n, sizeof(int));
+    wcache.data = malloc((size_t)n * disk.iounit_size);
+    if (!wcache.lines || !wcache.buckets || !wcache.order || !wcache.data) {
+        user_panic("can't allocate %lld bytes write cache", wcache.size);
+        return -ENOMEM;
+    }
+    for (i = 0; i < n; i++) {
+        wcache.lines[i].offset = -1;
+        wcache.lines[i].next = i + 1 < n ? i + 1 : -1;
+        wcache.buckets[i] = -1;
+    }
+    wcache.free = 0;
+    wcache.used = 0;
+    wcache.clock = 0;
+    wcache.nlines = n;
+    return 0;
+}
+
+void wcache_release(void) {
+    free(wcache.lines);
+    free(wcache.buckets);
+    free(wcache.order);
+    free(wcache.data);
+    wcache.lines = NULL;
+    wcache.buckets = NULL;
+    wcache.order = NULL;
+    wcache.data = NULL;
+    wcache.nlines = 0;
+}
+
+static int wcache_find(off_t offset) {
+    int i;
+    for (i = wcache.buckets[WCACHE_HASH(offset)]; i >= 0; i = wcache.lines[i].next) {
+        if (wcache.lines[i].offset == offset)
+            return i;
+    }
+    return -1;
+}
+
+static int wcache_insert(off_t offset) {
+    int idx = wcache.free;
+    int hash = WCACHE_HASH(offset);
+
+    wcache.free = wcache.lines[idx].next;
+    wcache.lines[idx].offset = offset;
+    wcache.lines[idx].stamp = wcache.clock++;
+    wcache.lines[idx].next = wcache.buckets[hash];
+    wcache.buckets[hash] = idx;
+    wcache.used++;
+    return idx;
+}
+
+static void wcache_drop(int idx) {
+    int *p = &wcache.buckets[WCACHE_HASH(wcache.lines[idx].offset)];
+
+    while (*p != idx)
+        p = &wcache.lines[*p].next;
+    *p = wcache.lines[idx].next;
+    wcache.lines[idx].offset = -1;
+    wcache.lines[idx].next = wcache.free;
+    wcache.free = idx;
+    wcache.used--;
+}
+/**
+ * @brief 丢弃[offset, offset + size)内的缓存扇区而不写回，用于DISCARD与RESET
+ */
+void wcache_invalidate(off_t offset, long long size) {
+    int i;
+    for (i = 0; i < wcache.nlines; i++) {
+        if (wcache.lines[i].offset >= offset && wcache.lines[i].offset < offset + size)
+            wcache_drop(i);
+    }
+}
+
+static int wcache_cmp(const void *a, const void *b) {
+    off_t x = wcache.lines[*(const int *)a].offset;
+    off_t y = wcache.lines[*(const int *)b].offset;
+    return x < y ? -1 : x > y;
+}
+/**
+ * @brief 把idx[0, n)中的扇区按地址排序写回后备存储并释放，相邻扇区合并为一次请求
+ * 
+ * @return long long 写回承担的延迟(ns)
+ */
+static long long wcache_destage(int fd, int *idx, int n) {
+    struct iovec iov[CONFIG_IOV_MAX];
+    long long delay = 0;
+    off_t start;
+    ssize_t size;
+    int i, j;
+
+    qsort(idx, n, sizeof(int), wcache_cmp);
+    for (i = 0; i < n; i = j) {
+        start = wcache.lines[idx[i]].offset;
+        for (j = i; j < n && j - i < CONFIG_IOV_MAX && 
+             wcache.lines[idx[j]].offset == start + (off_t)(j - i) * disk.iounit_size; j++) {
+            iov[j - i].iov_base = WCACHE_DATA(idx[j]);
+            iov[j - i].iov_len = disk.iounit_size;
+        }
+        size = (ssize_t)(j - i) * disk.iounit_size;
+        delay += emulate_account(fd, 1, start, size);
+        if (backend_io(fd, 1, iov, j - i, start) != size)
+            user_alert("destage error at %ld: %s", start, strerror(errno));
+    }
+    for (i = 0; i < n; i++)
+        wcache_drop(idx[i]);
+    return delay;
+}
+/**
+ * @brief 写回全部缓存，FLUSH与关闭设备时调用
+ * 
+ * @return long long 写回承担的延迟(ns)
+ */
+long long wcache_flush(int fd) {
+    int i, n = 0;
+    for (i = 0; i < wcache.nlines; i++) {
+        if (wcache.lines[i].offset >= 0)
+            wcache.order[n++] = i;
+    }
+    return n ? wcache_destage(fd, wcache.order, n) : 0;
+}
+/**
+ * @brief 缓存已满，按策略写回扇区腾出空间
+ */
+static long long wcache_evict(int fd) {
+    int i, victim = -1;
+
+    if (wcache.policy == WCACHE_BATCH) {
+        disk.xstat.wcache_evicted += wcache.used;
+        return wcache_flush(fd);
+    }
+    for (i = 0; i < wcache.nlines; i++) {
+        if (wcache.lines[i].offset >= 0 && 
+            (victim < 0 || wcache.lines[i].stamp < wcache.lines[victim].stamp))
+            victim = i;
+    }
+    disk.xstat.wcache_evicted++;
+    return wcache_destage(fd, &victim, 1);
+}
+/**
+ * @brief 睡眠期间释放disk.lock：延迟已经计入模拟时间，不必让其他请求跟着等
+ */
+static void wcache_delay(long long delay) {
+    DISK_UNLOCK(disk);
+    emulate_delay(delay);
+    DISK_LOCK(disk);
+}
+/**
+ * @brief 经过写缓存的读写，参数已由emulate_io检查
+ *   写: 逐扇区放入缓存，已缓存的扇区直接覆盖，只计传输延迟与腾空间时的写回
+ *   读: 全部命中时只计传输延迟，否则照常读盘，再用缓存中较新的扇区覆盖
+ * 缓存与数据都在disk.lock下处理完，之后才释放锁睡眠
+ */
+static ssize_t wcache_io(int fd, int is_write, const struct iovec *iov, int iovcnt, 
+                         off_t offset, ssize_t total) {
+    long long delay = 0;
+    off_t pos;
+    size_t done;
+    int i, idx, hits = 0;
+    char *buf;
+
+    if (!is_write) {
+        for (pos = offset; pos < offset + total; pos += disk.iounit_size)
+            hits += wcache_find(pos) >= 0;
+        if ((ssize_t)hits * disk.iounit_size < total) {
+            delay = emulate_account(fd, 0, offset, total);
+            if (backend_io(fd, 0, iov, iovcnt, offset) != total) {
+                user_alert("read error at %ld: %s", offset, strerror(errno));
+                return -EIO;
+            }
+        }
+        else {
+            INC_READCNT(disk);
+            delay = emulate_charge(XFER_LAT(disk, total));
+            stat_account(0, offset, total, delay);
+        }
+        if (hits == 0) {
+            wcache_delay(delay);
+            return total;
+        }
+    }
+
+    pos = offset;
+    for (i = 0; i < iovcnt; i++) {
+        for (done = 0; done < iov[i].iov_len; done += disk.iounit_size, pos += disk.iounit_size) {
+            buf = (char *)iov[i].iov_base + done;
+            idx = wcache_find(pos);
+            if (!is_write) {
+                if (idx >= 0)
+                    memcpy(buf, WCACHE_DATA(idx), disk.iounit_size);
+                continue;
+            }
+            if (idx >= 0) {
+                disk.xstat.wcache_absorbed++;
+            }
+            else {
+                if (wcache.used == wcache.nlines)
+                    delay += wcache_evict(fd);
+                idx = wcache_insert(pos);
+            }
+            if (wcache.policy == WCACHE_LRU)
+                wcache.lines[idx].stamp = wcache.clock++;
+            memcpy(WCACHE_DATA(idx), buf, disk.iounit_size);
+        }
+    }
+    if (is_write) {
+        INC_WRITECNT(disk);
+        stat_account(1, offset, total, XFER_LAT(disk, total));
+        delay += emulate_charge(XFER_LAT(disk, total));
+    }
+    wcache_delay(delay);
+    return total;
+}
+/**
+ * @brief 丢弃[offset, offset + size)：在后备文件上打洞，释放宿主磁盘空间，之后读出全零；
+ * 文件系统不支持打洞时退化为写零
+ */
+int emulate_discard(int fd, off_t offset, long long size) {
+    char buf[4096] = {'\0'};
+    struct ddriver_member *m;
+    long long i, len;
+    off_t pos, moff;
+    unsigned mask;
+    int ret = 0;
+    IGNORE_ARG(fd);
+
+    if (size <= 0 || !IS_ADDR_ALIGN(size) || check_valid_range(offset, size) < 0)
+        return -EINVAL;
+    /* 失效与打洞之间不能插入写入：disk.lock挡住缓存与同步路径，成员锁挡住在途的异步与条带传输，
+     * 单个镜像时也是如此，mask只含0号成员 */
+    mask = stripe_mask(offset, size);
+    DISK_LOCK(disk);
+    wcache_invalidate(offset, size);                 /* Dirty sectors die with the range */
+    stripe_lock(mask);
+    for (pos = offset; pos < offset + size && ret == 0; pos += len) {
+        m = &member[stripe_map(pos, offset + size - pos, &moff, &len)];
+        if (fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, moff, len) == 0)
+            continue;
+        if (errno != EOPNOTSUPP) {
+            ret = -errno;
+            break;
+        }
+        if (disk.backend == DDRIVER_BACKEND_MMAP) {
+            memset(m->map + moff, 0, len);
+        }
+        else {
+            for (i = 0; i < len; i += sizeof(buf))
+                if (pwrite(m->fd, buf, len - i < (long long)sizeof(buf) ? len - i : sizeof(buf), 
+                           moff + i) < 0) {
+                    ret = -errno;
+                    break;
+                }
+        }
+    }
+    stripe_unlock(mask);
+    if (ret == 0)
+        disk.xstat.discard_bytes += size;
+    DISK_UNLOCK(disk);
+    return ret;
+}
+/**
+ * @brief 定位式读写的公共路径：移动模拟磁头、计延迟后完成IO，
+ * 不依赖也不修改fd的文件偏移，调用方需持有disk.lock；
+ * 条带化或开启写缓存时睡眠期间释放disk.lock，条带化时只占用涉及的成员
+ */
+ssize_t emulate_io(int fd, int is_write, const struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t total = check_valid_vec(iov, iovcnt);
+    long long delay;
+    unsigned mask;
+    ssize_t ret;
+    if (total < 0)
+        return total;
+    if (check_valid_range(offset, total) < 0)
+        return -EINVAL;
+    if (wcache.nlines > 0)
+        return wcache_io(fd, is_write, iov, iovcnt, offset, total);
+
+    delay = emulate_account(fd, is_write, offset, total);
+    if (disk.stripes > 1) {                          /* Let other members serve meanwhile */
+        mask = stripe_mask(offset, total);
+        DISK_UNLOCK(disk);
+        stripe_lock(mask);
+        emulate_delay(delay);
+        ret = backend_io(fd, is_write, iov, iovcnt, offset);
+        stripe_unlock(mask);
+        DISK_LOCK(disk);
+    }
+    else {
+        emulate_delay(delay);
+        ret = backend_io(fd, is_write, iov, iovcnt, offset);
+    }
+    if (ret != total) {
+        user_alert("%s error at %ld: %s", is_write ? "write" : "read",
+                   offset, strerror(errno));
+        return -EIO;
+    }
+    return ret;
+}
+/**
+ * @brief 解析容量字符串，支持K/M/G后缀，如 "64G"、"4096"
+ * @return long long 字节数，非法时返回-1
+ */
+long long parse_size(const char *str) {
+    char *end;
+    long long val = strtoll(str, &end, 0);
+    if (end == str || val < 0)
+        return -1;
+    switch (*end) {
+    case 'g': case 'G': val <<= 10;   /* fall through */
+    case 'm': case 'M': val <<= 10;   /* fall through */
+    case 'k': case 'K': val <<= 10; end++; break;
+    default: break;
+    }
+    while (*end == ' ' || *end == '\t' || *end == '\n' || *end == 'B' || *end == 'b')
+        end++;
+    return *end == '\0' ? val : -1;
+}
+/**
+ * @brief 设置一项几何参数，key取disk_size/iounit_size/track_num/wcache_size/stripes/stripe_unit
+ */
+int set_geometry(const char *key, const char *val) {
+    long long v = parse_size(val);
+    if (v < 0) {
+        user_panic("bad value [%s] for %s", val, key);
+        return -EINVAL;
+    }
+    if (strcmp(key, "disk_size") == 0)
+        disk.layout_size = v;
+    else if (strcmp(key, "iounit_size") == 0 && v <= INT_MAX)
+        disk.iounit_size = v;
+    else if (strcmp(key, "track_num") == 0 && v <= INT_MAX)
+        disk.track_num = v;
+    else if (strcmp(key, "wcache_size") == 0)
+        wcache.size = v;
+    else if (strcmp(key, "stripes") == 0 && v <= CONFIG_MAX_STRIPES)
+        disk.stripes = v;
+    else if (strcmp(key, "stripe_unit") == 0 && v <= INT_MAX)
+        disk.stripe_unit = v;
+    else {
+        user_panic("unknown geometry key [%s]", key);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 加载磁盘几何参数：先读 ~/ddriver.conf（每行 key = value，#为注释），
+ * 再由环境变量 DDRIVER_DISK_SZ / DDRIVER_IO_SZ / DDRIVER_TRACKS / DDRIVER_WCACHE /
+ * DDRIVER_STRIPES / DDRIVER_STRIPE_UNIT 覆盖，track_num为每个条带成员的磁道数
+ */
+int load_geometry(const char *conf_path) {
+    char line[256], key[64], val[64];
+    const char *env;
+    FILE *conf;
+
+    disk.layout_size = CONFIG_DISK_SZ;
+    disk.iounit_size = CONFIG_BLOCK_SZ;
+    disk.track_num   = CONFIG_TRACK_NUM;
+    wcache.size      = CONFIG_WCACHE_SZ;
+    disk.stripes     = CONFIG_STRIPES;
+    disk.stripe_unit = CONFIG_STRIPE_UNIT;
+
+    conf = fopen(conf_path, "r");
+    if (conf != NULL) {
+        while (fgets(line, sizeof(line), conf) != NULL) {
+            char *hash = strchr(line, '#');
+            if (hash != NULL)
+                *hash = '\0';
+            if (sscanf(line, " %63[a-z_] = %63s", key, val) != 2)
+                continue;
+            if (set_geometry(key, val) < 0) {
+                fclose(conf);
+                return -EINVAL;
+            }
+        }
+        fclose(conf);
+    }
+    if ((env = getenv("DDRIVER_DISK_SZ")) != NULL && set_geometry("disk_size", env) < 0)
+        return -EINVAL;
+    if ((env = getenv("DDRIVER_IO_SZ")) != NULL && set_geometry("iounit_size", env) < 0)
+        return -EINVAL;
+    if ((env = getenv("DDRIVER_TRACKS")) != NULL && set_geometry("track_num", env) < 0)
+        return -EINVAL;
+    if ((env = getenv("DDRIVER_WCACHE")) != NULL && set_geometry("wcache_size", env) < 0)
+        return -EINVAL;
+    if ((env = getenv("DDRIVER_STRIPES")) != NULL && set_geometry("stripes", env) < 0)
+        return -EINVAL;
+    if ((env = getenv("DDRIVER_STRIPE_UNIT")) != NULL && set_geometry("stripe_unit", env) < 0)
+        return -EINVAL;
+
+    if (disk.iounit_size < 512 || (disk.iounit_size & (disk.iounit_size - 1)) != 0) {
+        user_panic("io unit %d must be a power of two >= 512", disk.iounit_size);
+        return -EINVAL;
+    }
+    if (disk.layout_size < disk.iounit_size || disk.layout_size % disk.iounit_size != 0) {
+        user_panic("disk size %lld must be a multiple of io unit %d",
+                   disk.layout_size, disk.iounit_size);
+        return -EINVAL;
+    }
+    if (disk.stripes < 1 || disk.stripe_unit < disk.iounit_size || 
+        disk.stripe_unit % disk.iounit_size != 0 ||
+        (disk.stripes > 1 && disk.layout_size % ((long long)disk.stripes * disk.stripe_unit) != 0)) {
+        user_panic("disk size %lld can't split into %d stripes of %d", 
+                   disk.layout_size, disk.stripes, disk.stripe_unit);
+        return -EINVAL;
+    }
+    if (disk.track_num < 1 || disk.track_num > MEMBER_SZ / disk.iounit_size) {
+        user_panic("bad track number: %d", disk.track_num);
+        return -EINVAL;
+    }
+    if (wcache.size > disk.layout_size || wcache.size / disk.iounit_size > INT_MAX) {
+        user_panic("write cache %lld larger than disk", wcache.size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/******************************************************************************
+* SECTION: Async Engine
+*******************************************************************************/
+/*
+ * 异步请求放在固定的槽位数组中，由两种引擎之一服务：
+ *   io_uring: 派发时完成磁头/计数的记账，数据传输交给内核，
+ *             延迟在收割完成事件时补上，调用方在提交和收割之间可以做别的事
+ *   worker:   工作线程派发请求后按记账的延迟睡眠，再读写后备存储
+ * mmap后端的数据传输就是memcpy，开启写缓存时数据要经过缓存，条带化时数据分散在多个镜像上，
+ * 这些情况总是使用worker引擎，开启写缓存时由worker持有disk.lock走同步路径emulate_io。
+ *
+ * 派发顺序由调度策略(DDRIVER_SCHED)决定，选取总在持有disk.lock时进行，
+ * 因此看到的是真实磁头位置：
+ *   fifo:     按提交顺序，提交即派发
+ *   clook:    从磁头向高地址单向扫描，到最高请求后跳回最低请求(默认)
+ *   scan:     电梯式双向扫描，在最远的请求处折返(LOOK)
+ *   deadline: 超过CONFIG_READ/WRITE_EXPIRE(模拟时间)的请求优先，否则同clook
+ * 除fifo外，提交的请求先"塞住"积攒，直到ddriver_poll_completions时才放行，
+ * 这样一批散落的写回能整体排序后再服务。
+ */
+#ifdef DDRIVER_HAVE_URING
+struct uring {
+    int       ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ptr, *cq_ptr;
+    size_t    sq_sz, cq_sz, sqes_sz;
+};
+static struct uring ring = { .ring_fd = -1 };
+
+static int uring_setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.ring_fd < 0) {
+        ring.ring_fd = -1;
+        return -errno;
+    }
+
+    ring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sq_ptr = mmap(NULL, ring.sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.ring_fd, IORING_OFF_SQ_RING);
+    ring.cq_ptr = mmap(NULL, ring.cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.ring_fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.ring_fd, IORING_OFF_SQES);
+    if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.ring_fd);
+        ring.ring_fd = -1;
+        return -ENOMEM;
+    }
+
+    ring.sq_head  = ring.sq_ptr + p.sq_off.head;
+    ring.sq_tail  = ring.sq_ptr + p.sq_off.tail;
+    ring.sq_mask  = ring.sq_ptr + p.sq_off.ring_mask;
+    ring.sq_array = ring.sq_ptr + p.sq_off.array;
+    ring.cq_head  = ring.cq_ptr + p.cq_off.head;
+    ring.cq_tail  = ring.cq_ptr + p.cq_off.tail;
+    ring.cq_mask  = ring.cq_ptr + p.cq_off.ring_mask;
+    ring.cqes     = ring.cq_ptr + p.cq_off.cqes;
+    return 0;
+}
+
+static void uring_teardown(void) {
+    if (ring.ring_fd < 0)
+        return;
+    munmap(ring.sqes, ring.sqes_sz);
+    munmap(ring.cq_ptr, ring.cq_sz);
+    munmap(ring.sq_ptr, ring.sq_sz);
+    close(ring.ring_fd);
+    ring.ring_fd = -1;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete) {
+    int ret = syscall(__NR_io_uring_enter, ring.ring_fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+/**
+ * @brief 只填写SQE，由uring_enter批量提交
+ */
+static void uring_queue(int fd, struct aio_req *req, int slot) {
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)req->buf;
+    sqe->len = req->size;
+    sqe->off = req->offset;
+    sqe->user_data = slot;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_reap(void) {
+    unsigned head = *ring.cq_head;
+    int n = 0;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct aio_req *req = &aio.reqs[cqe->user_data];
+        req->res = cqe->res == (int)req->size ? cqe->res : -EIO;
+        req->state = AIO_DONE;
+        req->seq = aio.done_seq++;
+        head++;
+        n++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+#endif /* DDRIVER_HAVE_URING */
+
+/**
+ * @brief 在dir方向上离head最近的PENDING请求，dir>0取offset>=head，dir<0取offset<head，
+ * 同一位置按提交顺序
+ */
+static int sched_nearest(off_t head, int dir) {
+    int i, pick = -1;
+    struct aio_req *r, *p;
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        r = &aio.reqs[i];
+        if (r->state != AIO_PENDING || (dir > 0) != (r->offset >= head))
+            continue;
+        p = pick < 0 ? NULL : &aio.reqs[pick];
+        if (p == NULL || (dir > 0 ? r->offset < p->offset : r->offset > p->offset) ||
+            (r->offset == p->offset && r->seq < p->seq))
+            pick = i;
+    }
+    return pick;
+}
+
+static int sched_fifo(off_t head) {
+    int i, pick = -1;
+    IGNORE_ARG(head);
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        if (aio.reqs[i].state == AIO_PENDING && 
+            (pick < 0 || aio.reqs[i].seq < aio.reqs[pick].seq))
+            pick = i;
+    }
+    return pick;
+}
+
+static int sched_clook(off_t head) {
+    int pick = sched_nearest(head, 1);
+    return pick >= 0 ? pick : sched_nearest(0, 1);
+}
+
+static int sched_scan(off_t head) {
+    int pick = sched_nearest(head, aio.scan_dir);
+    if (pick < 0) {
+        aio.scan_dir = -aio.scan_dir;
+        pick = sched_nearest(head, aio.scan_dir);
+    }
+    return pick;
+}
+
+static int sched_deadline(off_t head) {
+    int i, pick = -1;
+    unsigned long long expire;
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        if (aio.reqs[i].state != AIO_PENDING)
+            continue;
+        expire = aio.reqs[i].is_write ? CONFIG_WRITE_EXPIRE : CONFIG_READ_EXPIRE;
+        if (disk.sim_ns - aio.reqs[i].stamp >= expire &&
+            (pick < 0 || aio.reqs[i].seq < aio.reqs[pick].seq))
+            pick = i;
+    }
+    return pick >= 0 ? pick : sched_clook(head);
+}
+
+static const struct sched_policy sched_policies[] = {
+    { "clook",    sched_clook,    1 },               /* Default */
+    { "fifo",     sched_fifo,     0 },
+    { "scan",     sched_scan,     1 },
+    { "deadline", sched_deadline, 1 },
+};
+
+/**
+ * @brief 按名字选择调度策略，NULL或未知名字使用默认的clook
+ */
+static const struct sched_policy *sched_select(const char *name) {
+    size_t i;
+    if (name == NULL)
+        return &sched_policies[0];
+    for (i = 0; i < sizeof(sched_policies) / sizeof(sched_policies[0]); i++) {
+        if (strcmp(sched_policies[i].name, name) == 0)
+            return &sched_policies[i];
+    }
+    user_panic("unknown scheduler [%s], using %s", name, sched_policies[0].name);
+    return &sched_policies[0];
+}
+
+/**
+ * @brief 是否还有PENDING请求；不经过调度策略，不会改变scan的扫描方向
+ */
+static int aio_pending(void) {
+    int i;
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        if (aio.reqs[i].state == AIO_PENDING)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 按调度策略选出下一个可派发的请求，调用方需持有aio.lock与disk.lock
+ */
+static int aio_pick(void) {
+    if (aio.sched->plug && !aio.unplugged)
+        return -1;
+    return aio.sched->pick(disk.head);
+}
+
+/**
+ * @brief 派发请求：统计寻道开销并标记为飞行中，调用方需持有aio.lock与disk.lock
+ */
+static void aio_dispatch(struct aio_req *req) {
+    if (disk.head != req->offset)
+        aio.stat.seek_ns += emulate_rotate(aio.fd, disk.head, req->offset);
+    aio.stat.reqs++;
+    req->state = AIO_INFLIGHT;
+    if (!aio_pending())                              /* Batch drained, plug again */
+        aio.unplugged = 0;
+}
+
+/**
+ * @brief 派发请求并记账，调用方需持有aio.lock与disk.lock
+ * 
+ * @return long long 该请求应承担的延迟(ns)
+ */
+static long long aio_account(struct aio_req *req) {
+    aio_dispatch(req);
+    return emulate_account(aio.fd, req->is_write, req->offset, req->size);
+}
+
+static void sched_report(void) {
+    double seek = aio.stat.seek_ns / 1e6, fifo = aio.stat.fifo_seek_ns / 1e6;
+    if (aio.stat.reqs == 0)
+        return;
+    user_info("sched %s: %llu async reqs, seek %.3fms vs fifo %.3fms, saved %.1f%%",
+              aio.sched->name, aio.stat.reqs, seek, fifo, 
+              fifo > 0 ? (fifo - seek) * 100 / fifo : 0.0);
+}
+
+#ifdef DDRIVER_HAVE_URING
+/**
+ * @brief 把可派发的请求按调度顺序一次性交给io_uring，调用方需持有aio.lock
+ */
+static int uring_dispatch(void) {
+    int slots[CONFIG_AIO_DEPTH];
+    int pick, i, n = 0, done, ret, stalls = 0, busy;
+
+    DISK_LOCK(disk);
+    while ((pick = aio_pick()) >= 0) {
+        aio.reqs[pick].delay = aio_account(&aio.reqs[pick]);
+        uring_queue(aio.fd, &aio.reqs[pick], pick);
+        slots[n++] = pick;
+    }
+    DISK_UNLOCK(disk);
+    /* 内核可能只取走一部分SQE，余下的必须继续提交，否则它们永远不会完成 */
+    for (done = 0; done < n; done += ret) {
+        ret = uring_enter(n - done, 0);
+        if (ret > 0) {
+            stalls = 0;
+            continue;
+        }
+        if ((ret == 0 || ret == -EAGAIN || ret == -EBUSY || ret == -EINTR) &&
+            ++stalls <= CONFIG_URING_STALLS) {
+            /* 先收割腾出CQ；没有可收割的就阻塞等一个已提交请求完成，而不是立刻重试空转 */
+            for (i = 0, busy = 0; i < CONFIG_AIO_DEPTH; i++)
+                busy += aio.reqs[i].state == AIO_INFLIGHT;
+            if (uring_reap() == 0 && busy > n - done && uring_enter(0, 1) >= 0)
+                uring_reap();
+            ret = 0;
+            continue;
+        }
+        if (ret >= 0)                                /* Kernel made no progress for too long */
+            ret = -EBUSY;
+        /* Hard error: take back the SQEs the kernel has not consumed and fail them */
+        __atomic_store_n(ring.sq_tail, *ring.sq_tail - (n - done), __ATOMIC_RELEASE);
+        for (i = done; i < n; i++) {
+            aio.reqs[slots[i]].res = ret;
+            aio.reqs[slots[i]].state = AIO_DONE;
+            aio.reqs[slots[i]].seq = aio.done_seq++;
+        }
+        return ret;
+    }
+    return 0;
+}
+#endif /* DDRIVER_HAVE_URING */
+
+static int aio_outstanding(void) {
+    int i, n = 0;
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        if (aio.reqs[i].state == AIO_PENDING || aio.reqs[i].state == AIO_INFLIGHT)
+            n++;
+    }
+    return n;
+}
+
+static void *aio_worker(void *arg) {
+    struct aio_req *req;
+    struct iovec iov;
+    long long delay;
+    unsigned mask;
+    ssize_t ret;
+    int pick;
+    IGNORE_ARG(arg);
+
+    AIO_LOCK(aio);
+    while (!aio.stop) {
+        DISK_LOCK(disk);
+        pick = aio_pick();
+        if (pick < 0) {
+            DISK_UNLOCK(disk);
+            pthread_cond_wait(&aio.submit_cond, &aio.lock);
+            continue;
+        }
+        req = &aio.reqs[pick];
+        iov.iov_base = req->buf;
+        iov.iov_len = req->size;
+        if (wcache.nlines > 0) {                     /* Cache lines are shared, serve under disk.lock */
+            aio_dispatch(req);
+            AIO_UNLOCK(aio);
+            ret = emulate_io(aio.fd, req->is_write, &iov, 1, req->offset);
+            DISK_UNLOCK(disk);
+        }
+        else {
+            delay = aio_account(req);
+            DISK_UNLOCK(disk);
+            AIO_UNLOCK(aio);
+
+            mask = stripe_mask(req->offset, req->size);
+            stripe_lock(mask);                       /* One request per platter at a time */
+            emulate_delay(delay);
+            ret = backend_io(aio.fd, req->is_write, &iov, 1, req->offset);
+            stripe_unlock(mask);
+            if (ret != (ssize_t)req->size) {
+                user_alert("%s error at %ld: %s", req->is_write ? "write" : "read",
+                           req->offset, strerror(errno));
+                ret = -EIO;
+            }
+        }
+
+        AIO_LOCK(aio);
+        req->res = ret;
+        req->state = AIO_DONE;
+        req->seq = aio.done_seq++;
+        pthread_cond_broadcast(&aio.done_cond);
+    }
+    AIO_UNLOCK(aio);
+    return NULL;
+}
+
+/**
+ * @brief 首次提交时初始化异步引擎，调用方需持有aio.lock
+ */
+static int aio_start(int fd) {
+    int i;
+    char *engine = getenv("DDRIVER_AIO");
+
+    if (aio.started)
+        return 0;
+    aio.fd = fd;
+    aio.use_uring = 0;
+#ifdef DDRIVER_HAVE_URING
+    if (disk.backend == DDRIVER_BACKEND_FILE && wcache.nlines == 0 && disk.stripes == 1 &&
+        (engine == NULL || strcmp(engine, "thread") != 0) &&
+        uring_setup(CONFIG_AIO_DEPTH) == 0) {
+        aio.use_uring = 1;
+    }
+#else
+    IGNORE_ARG(engine);
+#endif
+    if (!aio.use_uring) {
+        aio.stop = 0;
+        for (i = 0; i < CONFIG_AIO_WORKERS; i++) {
+            if (pthread_create(&aio.workers[i], NULL, aio_worker, NULL) != 0) {
+                user_alert("can't start aio worker: %s", strerror(errno));
+                aio.stop = 1;
+                pthread_cond_broadcast(&aio.submit_cond);
+                AIO_UNLOCK(aio);
+                while (--i >= 0)
+                    pthread_join(aio.workers[i], NULL);
+                AIO_LOCK(aio);
+                return -EAGAIN;
+            }
+        }
+    }
+    aio.started = 1;
+    return 0;
+}
+
+/**
+ * @brief 关闭设备前等待所有请求完成并回收引擎
+ */
+static void aio_stop(void) {
+    int i;
+    struct ddriver_cqe cqe;
+
+    while (1) {
+        AIO_LOCK(aio);
+        i = aio.started ? aio_outstanding() : 0;
+        AIO_UNLOCK(aio);
+        if (i == 0)
+            break;
+        ddriver_poll_completions(aio.fd, &cqe, 1, 1);
+    }
+
+    AIO_LOCK(aio);
+    if (!aio.started) {
+        AIO_UNLOCK(aio);
+        return;
+    }
+    aio.started = 0;
+    sched_report();
+    if (aio.use_uring) {
+#ifdef DDRIVER_HAVE_URING
+        uring_teardown();
+#endif
+        AIO_UNLOCK(aio);
+    }
+    else {
+        aio.stop = 1;
+        pthread_cond_broadcast(&aio.submit_cond);
+        AIO_UNLOCK(aio);
+        for (i = 0; i < CONFIG_AIO_WORKERS; i++)
+            pthread_join(aio.workers[i], NULL);
+    }
+    memset(aio.reqs, 0, sizeof(aio.reqs));
+}
+
+/**
+ * @brief 写屏障的前半部分：放行并等待此前提交的异步请求全部完成，完成事件留给调用方收割
+ */
+static void aio_quiesce(void) {
+    AIO_LOCK(aio);
+    while (aio.started && aio_outstanding() > 0) {
+        aio.unplugged = 1;
+#ifdef DDRIVER_HAVE_URING
+        if (aio.use_uring) {
+            uring_dispatch();
+            uring_reap();
+            if (aio_outstanding() == 0)
+                break;
+            AIO_UNLOCK(aio);
+            uring_enter(0, 1);
+            AIO_LOCK(aio);
+            continue;
+        }
+#endif
+        pthread_cond_broadcast(&aio.submit_cond);
+        pthread_cond_wait(&aio.done_cond, &aio.lock);
+    }
+    AIO_UNLOCK(aio);
+}
+
+static int aio_submit(int fd, int is_write, char *buf, size_t size, off_t offset, void *priv) {
+    struct aio_req *req = NULL;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    int i, ret;
+
+    if (check_valid_vec(&iov, 1) < 0)
+        return -EIO;
+    if (check_valid_range(offset, size) < 0)
+        return -EINVAL;
+
+    AIO_LOCK(aio);
+    ret = aio_start(fd);
+    if (ret < 0) {
+        AIO_UNLOCK(aio);
+        return ret;
+    }
+    for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+        if (aio.reqs[i].state == AIO_FREE) {
+            req = &aio.reqs[i];
+            break;
+        }
+    }
+    if (req == NULL) {
+        AIO_UNLOCK(aio);
+        return -EAGAIN;
+    }
+
+    req->is_write = is_write;
+    req->buf = buf;
+    req->size = size;
+    req->offset = offset;
+    req->priv = priv;
+    req->res = 0;
+    req->delay = 0;
+    req->seq = aio.submit_seq++;
+
+    DISK_LOCK(disk);
+    req->stamp = disk.sim_ns;
+    if (aio_outstanding() == 0)                      /* Idle queue: FIFO starts from here */
+        aio.fifo_head = disk.head;
+    DISK_UNLOCK(disk);
+    if (aio.fifo_head != offset)
+        aio.stat.fifo_seek_ns += emulate_rotate(fd, aio.fifo_head, offset);
+    aio.fifo_head = offset + size;
+    req->state = AIO_PENDING;
+
+#ifdef DDRIVER_HAVE_URING
+    if (aio.use_uring) {
+        uring_dispatch();                            /* Failures surface as cqes */
+        AIO_UNLOCK(aio);
+        return 0;
+    }
+#endif
+    pthread_cond_signal(&aio.submit_cond);
+    AIO_UNLOCK(aio);
     return 0;
 }
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 打开(必要时创建)一个后备镜像并扩展为稀疏文件，mmap后端同时映射
+ * 
+ * @return int 文件描述符，失败返回负值
+ */
+static int member_open(struct ddriver_member *m, const char *path) {
+    struct stat st;
+    int ret;
+
+    if (access(path, F_OK) == 0) {
+        m->fd = open(path, O_RDWR);
+    }
+    else {
+        m->fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    }
+    if (m->fd < 0) {
+        user_panic("can't open device: %s", path);
+        return m->fd;
+    }
+    if (fstat(m->fd, &st) < 0 || 
+        (st.st_size < MEMBER_SZ && ftruncate(m->fd, MEMBER_SZ) < 0)) {
+        ret = errno;                                 /* Sparse image, blocks allocated on write */
+        user_panic("low space");
+        close(m->fd);
+        m->fd = -1;
+        return -ret;
+    }
+    m->map = NULL;
+    if (disk.backend == DDRIVER_BACKEND_MMAP) {
+        m->map = mmap(NULL, MEMBER_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+        if (m->map == MAP_FAILED) {
+            user_panic("can't map device: %s", strerror(errno));
+            m->map = NULL;
+            close(m->fd);
+            m->fd = -1;
+            return -1;
+        }
+    }
+    return m->fd;
+}
+
+static void member_close(struct ddriver_member *m) {
+    if (m->map != NULL) {
+        msync(m->map, MEMBER_SZ, MS_SYNC);
+        munmap(m->map, MEMBER_SZ);
+        m->map = NULL;
+    }
+    if (m->fd >= 0)
+        close(m->fd);
+    m->fd = -1;
+}
+
+static void stripe_report(void) {
+    int i;
+    for (i = 0; i < disk.stripes && disk.stripes > 1; i++)
+        user_info("stripe member %d: busy %.3fms", i, member[i].busy_ns / 1e6);
+}
+/**
+ * @brief 打开驱动，后端由环境变量DDRIVER_BACKEND选择(file|mmap)，默认file
  * 
  * @return int 文件描述符
  */
 int ddriver_open(char *path) {
-    int fd, ret = 0;
+    char *backend = getenv("DDRIVER_BACKEND");
+    if (backend != NULL && strcmp(backend, "mmap") == 0) {
+        return ddriver_open_backend(path, DDRIVER_BACKEND_MMAP);
+    }
+    return ddriver_open_backend(path, DDRIVER_BACKEND_FILE);
+}
+/**
+ * @brief 打开失败时撤销已完成的步骤：关闭前nmembers个成员、trace、写缓存与日志
+ */
+static void open_unwind(int nmembers) {
+    while (--nmembers >= 0)
+        member_close(&member[nmembers]);
+    if (tracef != NULL) {
+        fclose(tracef);
+        tracef = NULL;
+    }
+    wcache_release();
+    if (debugf != NULL) {
+        fclose(debugf);
+        debugf = NULL;
+    }
+}
+/**
+ * @brief 以指定后端打开驱动
+ * 
+ * @param path 
+ * @param backend DDRIVER_BACKEND_FILE: read/write后备文件
+ *                DDRIVER_BACKEND_MMAP: 映射后备文件，memcpy读写，FLUSH或关闭时msync
+ * 环境变量DDRIVER_CLOCK=virtual时只累计模拟时间而不真正睡眠，
+ * 累计值通过IOC_REQ_DEVICE_SIM_TIME查询；
+ * 环境变量DDRIVER_SCHED=clook|scan|deadline|fifo选择异步请求的调度策略
+ * 磁盘几何参数见load_geometry，容量可超过4GiB，此时需用IOC_REQ_DEVICE_SIZE64查询；
+ * wcache_size(DDRIVER_WCACHE)非零时开启写缓存，DDRIVER_WCACHE_POLICY=lru|fifo|batch选择写回策略；
+ * DDRIVER_TRACE=<path>时把每次调用记入跟踪文件，格式见ddriver_trace.h；
+ * stripes(DDRIVER_STRIPES)大于1时磁盘条带化到path、path.1、path.2...多个镜像上
+ * @return int 文件描述符
+ */
+int ddriver_open_backend(char *path, int backend) {
+    int fd, i, ret = 0;
+    char *clock;
     char device_path[128] = {0};
+    char member_path[140] = {0};
     char log_path[128] = {0};
+    char conf_path[128] = {0};
     
     sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
     sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
+    sprintf(conf_path, "%s/" DEVICE_CONF, getpwuid(getuid())->pw_dir);
+    sprintf(stat_path, "%s/" DEVICE_STAT, getpwuid(getuid())->pw_dir);
     
     if (strcmp(device_path, path) != 0) {
         user_panic("wrong path [%s], should be [%s]", path, device_path);
         return -1;
     }
-
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
-    }
-    else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    debugf = fopen(log_path, "w+");                  /* First, nothing to undo if it fails */
+    if (debugf == NULL) {
+        user_panic("can't init log: %s", log_path);
+        return -1;
     }
-    if (fd < 0) {
-        user_panic("can't open device: %d", fd);
-        return fd;
+    if (load_geometry(conf_path) < 0) {
+        open_unwind(0);
+        return -1;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
-        return ret;
+    disk.xstat.region_size = (disk.layout_size + DDRIVER_HEAT_REGIONS - 1) / DDRIVER_HEAT_REGIONS;
+    wcache_release();
+    if (wcache_init(getenv("DDRIVER_WCACHE_POLICY")) < 0 || trace_open() < 0) {
+        open_unwind(0);
+        return -1;
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
-        user_panic("can't init log: %s", log_path);
-        return -1;
+    disk.backend = backend;
+    for (i = 0; i < disk.stripes; i++) {
+        if (i > 0)
+            sprintf(member_path, "%s.%d", device_path, i);
+        ret = member_open(&member[i], i ? member_path : device_path);
+        if (ret < 0) {
+            open_unwind(i);
+            return ret;
+        }
+        member[i].head = 0;
+        member[i].busy_ns = 0;
     }
+    fd = member[0].fd;
+    disk.map = member[0].map;
+    aio.sched = sched_select(getenv("DDRIVER_SCHED"));
+    clock = getenv("DDRIVER_CLOCK");
+    disk.vclock = clock != NULL && strcmp(clock, "virtual") == 0;
 
     return fd;
 }
@@ -168,7 +1761,49 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    int i, ret;
+    aio_stop();
+    DISK_LOCK(disk);
+    emulate_delay(wcache_flush(fd));
+    wcache_release();
+    DISK_UNLOCK(disk);
+    stat_dump();
+    if (tracef != NULL) {
+        fclose(tracef);
+        tracef = NULL;
+    }
+    stripe_report();
+    for (i = 1; i < disk.stripes; i++)
+        member_close(&member[i]);
+    if (disk.map != NULL) {
+        msync(disk.map, MEMBER_SZ, MS_SYNC);
+        munmap(disk.map, MEMBER_SZ);
+        disk.map = NULL;
+    }
+    member[0].map = NULL;
+    member[0].fd = -1;
+    ret = close(fd);
+    if (debugf != NULL) {                             /* Was never closed, so the log could be lost */
+        fclose(debugf);
+        debugf = NULL;
+    }
+    return ret;
+}
+/**
+ * @brief 开启写缓存或条带化时的ddriver_write/ddriver_read：在磁头处走定位式路径，
+ * 再把磁头与文件偏移移到请求末尾，调用方需持有disk.lock，返回前释放
+ */
+static int head_rw(int fd, int is_write, char *buf, size_t size) {
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    off_t pos = disk.head;
+    ssize_t ret = emulate_io(fd, is_write, &iov, 1, pos);
+
+    if (ret >= 0) {
+        disk.head = pos + size;
+        lseek(fd, disk.head, SEEK_SET);
+    }
+    DISK_UNLOCK(disk);
+    return ret < 0 ? ret : disk.iounit_size;
 }
 /**
  * @brief 磁盘头SEEK
@@ -176,26 +1811,38 @@ int ddriver_close(int fd) {
  * @param fd 
  * @param offset 
  * @param whence 
- * @return int 
+ * @return off_t 新的磁头位置
  */
-int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+off_t ddriver_seek(int fd, off_t offset, int whence){
+    off_t ret = 0;
+    off_t cur = 0;
 
     if (!IS_ADDR_ALIGN(offset)) {
         user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+                      offset, disk.iounit_size);
         return -EINVAL;
     }
 
+    DISK_LOCK(disk);
     INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
-    ret = lseek(fd, offset, whence);
+    cur = disk.head;
+    /* 以disk.head为准，文件偏移可能因定位式读写而与之不同 */
+    ret = whence == SEEK_SET ? offset : whence == SEEK_CUR ? cur + offset :
+          whence == SEEK_END ? disk.layout_size + offset : -1;
+    if (ret < 0)
+        errno = EINVAL;
+    else if (disk.stripes <= 1)                      /* Striped: logical head, members seek on access */
+        ret = lseek(fd, ret, SEEK_SET);
     if (ret < 0) {
+        DISK_UNLOCK(disk);
         user_panic("seek error: %s", strerror(errno));
         return ret;
     }
-    emulate_rotate(fd, cur, ret);
+    disk.head = ret;
+    trace_record(DDRIVER_TRACE_SEEK, ret, 0);
+    disk.xstat.seek_dist += llabs(ret - cur);
+    emulate_delay(emulate_charge(emulate_rotate(fd, cur, ret)));
+    DISK_UNLOCK(disk);
     return ret;
 }
 /**
@@ -207,15 +1854,35 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    ssize_t res;
+    res = check_valid(size);
     if(res < 0)
         return res;
         
+    DISK_LOCK(disk);
+    trace_record(DDRIVER_TRACE_WRITE, disk.head, size);      /* 在锁内读磁头 */
+    if (wcache.nlines > 0 || disk.stripes > 1)
+        return head_rw(fd, 1, buf, size);
+    if (disk.backend == DDRIVER_BACKEND_MMAP && disk.head + size > disk.layout_size) {
+        DISK_UNLOCK(disk);
+        user_alert("disk head reach the end");
+        return -EINVAL;
+    }
     RW_DELAY(disk, write);
-    write(fd, buf, size);
+    stat_account(1, disk.head, size, RW_LAT(disk, write, size));
+    if (disk.backend == DDRIVER_BACKEND_MMAP)
+        memcpy(disk.map + disk.head, buf, size);
+    else if ((res = pwrite(fd, buf, size, disk.head)) != (ssize_t)size) {  /* 在磁头处传输，与记账一致 */
+        int err = res < 0 ? errno : EIO;
+        user_alert("write error at %lld: %s", (long long)disk.head, strerror(err));
+        DISK_UNLOCK(disk);
+        return -err;
+    }
 
+    disk.head += size;
     INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    DISK_UNLOCK(disk);
+    return disk.iounit_size;
 }
 /**
  * @brief 
@@ -226,15 +1893,188 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    ssize_t res;
+    res = check_valid(size);
     if(res < 0)
         return res;
 
+    DISK_LOCK(disk);
+    trace_record(DDRIVER_TRACE_READ, disk.head, size);      /* 在锁内读磁头 */
+    if (wcache.nlines > 0 || disk.stripes > 1)
+        return head_rw(fd, 0, buf, size);
+    if (disk.backend == DDRIVER_BACKEND_MMAP && disk.head + size > disk.layout_size) {
+        DISK_UNLOCK(disk);
+        user_alert("disk head reach the end");
+        return -EINVAL;
+    }
     RW_DELAY(disk, read);
-    read(fd, buf, size);
+    stat_account(0, disk.head, size, RW_LAT(disk, read, size));
+    if (disk.backend == DDRIVER_BACKEND_MMAP)
+        memcpy(buf, disk.map + disk.head, size);
+    else if ((res = pread(fd, buf, size, disk.head)) != (ssize_t)size) {  /* 在磁头处传输，与记账一致 */
+        int err = res < 0 ? errno : EIO;
+        user_alert("read error at %lld: %s", (long long)disk.head, strerror(err));
+        DISK_UNLOCK(disk);
+        return -err;
+    }
 
+    disk.head += size;
     INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    DISK_UNLOCK(disk);
+    return disk.iounit_size;
+}
+/**
+ * @brief 向量写入，从offset开始连续写入多个IO单位，只计一次SEEK和一次写延迟
+ * 
+ * @param fd 
+ * @param offset 起始位置，需与IO单位对齐
+ * @param iov 每一项大小都必须是IO单位的整数倍
+ * @param iovcnt 
+ * @return ssize_t 写入的字节数，失败返回负值
+ */
+ssize_t ddriver_writev(int fd, off_t offset, const struct iovec *iov, int iovcnt){
+    ssize_t ret;
+    trace_vec(DDRIVER_TRACE_PWRITE, offset, iov, iovcnt);
+    DISK_LOCK(disk);
+    ret = emulate_io(fd, 1, iov, iovcnt, offset);
+    DISK_UNLOCK(disk);
+    return ret;
+}
+/**
+ * @brief 向量读出，从offset开始连续读出多个IO单位，只计一次SEEK和一次读延迟
+ * 
+ * @param fd 
+ * @param offset 起始位置，需与IO单位对齐
+ * @param iov 每一项大小都必须是IO单位的整数倍
+ * @param iovcnt 
+ * @return ssize_t 读出的字节数，失败返回负值
+ */
+ssize_t ddriver_readv(int fd, off_t offset, const struct iovec *iov, int iovcnt){
+    ssize_t ret;
+    trace_vec(DDRIVER_TRACE_PREAD, offset, iov, iovcnt);
+    DISK_LOCK(disk);
+    ret = emulate_io(fd, 0, iov, iovcnt, offset);
+    DISK_UNLOCK(disk);
+    return ret;
+}
+/**
+ * @brief 定位写入，不经过ddriver_seek，磁头位置由驱动内部维护，可多线程并发调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 起始位置，需与IO单位对齐
+ * @return ssize_t 写入的字节数，失败返回负值
+ */
+ssize_t ddriver_pwrite(int fd, char *buf, size_t size, off_t offset){
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    return ddriver_writev(fd, offset, &iov, 1);
+}
+/**
+ * @brief 定位读出，不经过ddriver_seek，磁头位置由驱动内部维护，可多线程并发调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 起始位置，需与IO单位对齐
+ * @return ssize_t 读出的字节数，失败返回负值
+ */
+ssize_t ddriver_pread(int fd, char *buf, size_t size, off_t offset){
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    return ddriver_readv(fd, offset, &iov, 1);
+}
+/**
+ * @brief 异步写入，立即返回，完成后通过ddriver_poll_completions收割
+ * 
+ * @param fd 
+ * @param buf 在完成前必须保持有效
+ * @param size IO单位的整数倍
+ * @param offset 起始位置，需与IO单位对齐
+ * @param priv 原样带回ddriver_cqe.priv
+ * @return int 0成功，队列已满返回-EAGAIN
+ */
+int ddriver_submit_write(int fd, char *buf, size_t size, off_t offset, void *priv){
+    trace_record(DDRIVER_TRACE_AWRITE, offset, size);
+    return aio_submit(fd, 1, buf, size, offset, priv);
+}
+/**
+ * @brief 异步读出，立即返回，完成后通过ddriver_poll_completions收割
+ * 
+ * @param fd 
+ * @param buf 在完成前必须保持有效
+ * @param size IO单位的整数倍
+ * @param offset 起始位置，需与IO单位对齐
+ * @param priv 原样带回ddriver_cqe.priv
+ * @return int 0成功，队列已满返回-EAGAIN
+ */
+int ddriver_submit_read(int fd, char *buf, size_t size, off_t offset, void *priv){
+    trace_record(DDRIVER_TRACE_AREAD, offset, size);
+    return aio_submit(fd, 0, buf, size, offset, priv);
+}
+/**
+ * @brief 收割已完成的异步请求，同时在飞行中的请求之间不保证完成顺序
+ * 
+ * @param fd 
+ * @param cqes 
+ * @param max cqes容量
+ * @param min_complete 至少等待多少个完成，0表示不等待；没有未完成请求时直接返回
+ * @return int 收割到的个数
+ */
+int ddriver_poll_completions(int fd, struct ddriver_cqe *cqes, int max, int min_complete){
+    struct aio_req *req;
+    int i, pick, n = 0;
+    long long delay = 0;
+    IGNORE_ARG(fd);
+
+    trace_record(DDRIVER_TRACE_POLL, max, min_complete);
+    AIO_LOCK(aio);
+    if (!aio.started) {
+        AIO_UNLOCK(aio);
+        return 0;
+    }
+    while (1) {
+        aio.unplugged = 1;                           /* Release the plugged batch */
+#ifdef DDRIVER_HAVE_URING
+        if (aio.use_uring) {
+            uring_dispatch();
+            uring_reap();
+        }
+#endif
+        pthread_cond_broadcast(&aio.submit_cond);
+        while (n < max) {
+            pick = -1;
+            for (i = 0; i < CONFIG_AIO_DEPTH; i++) {
+                if (aio.reqs[i].state == AIO_DONE && 
+                    (pick < 0 || aio.reqs[i].seq < aio.reqs[pick].seq))
+                    pick = i;
+            }
+            if (pick < 0)
+                break;
+            req = &aio.reqs[pick];
+            cqes[n].priv = req->priv;
+            cqes[n].res = req->res;
+            delay += req->delay;
+            req->state = AIO_FREE;
+            n++;
+        }
+        if (n >= min_complete || n >= max || aio_outstanding() == 0)
+            break;
+#ifdef DDRIVER_HAVE_URING
+        if (aio.use_uring) {
+            AIO_UNLOCK(aio);
+            i = uring_enter(0, 1);
+            AIO_LOCK(aio);
+            if (i < 0 && i != -EINTR)
+                break;
+            continue;
+        }
+#endif
+        pthread_cond_wait(&aio.done_cond, &aio.lock);
+    }
+    AIO_UNLOCK(aio);
+
+    emulate_delay(delay);
+    return n;
 }
 /**
  * @brief 
@@ -246,32 +2086,98 @@ int ddriver_read(int fd, char *buf, size_t size){
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
     struct ddriver_state state;
+    struct ddriver_map_io *map_io;
+    struct ddriver_discard *discard;
+    unsigned long long region;
+    int size, i;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+        if (disk.layout_size > INT_MAX)               /* Use IOC_REQ_DEVICE_SIZE64 */
+            return -EOVERFLOW;
+        size = disk.layout_size;
+        memcpy(arg, &size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SIZE64:
+        memcpy(arg, &disk.layout_size, sizeof(unsigned long long));
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
+        DISK_LOCK(disk);
         state.read_cnt = disk.read_cnt;
         state.write_cnt = disk.write_cnt;
         state.seek_cnt = disk.seek_cnt;
+        DISK_UNLOCK(disk);
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
+        trace_record(DDRIVER_TRACE_RESET, 0, 0);
         lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+        size = emulate_discard(fd, 0, disk.layout_size);   /* One punch over the image */
+        if (size < 0)
+            return size;
+        DISK_LOCK(disk);
+        disk.head = 0;
+        for (i = 0; i < disk.stripes; i++) {
+            member[i].head = 0;
+            member[i].busy_ns = 0;
         }
-        lseek(fd, 0, SEEK_SET);
         disk.read_cnt = 0;
         disk.write_cnt = 0;
         disk.seek_cnt = 0;
+        disk.sim_ns = 0;
+        disk.last_end = 0;
+        region = disk.xstat.region_size;
+        memset(&disk.xstat, 0, sizeof(disk.xstat));
+        disk.xstat.region_size = region;
+        DISK_UNLOCK(disk);
+        AIO_LOCK(aio);
+        memset(&aio.stat, 0, sizeof(aio.stat));
+        AIO_UNLOCK(aio);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         memcpy(arg, &disk.iounit_size, sizeof(int));
         break;
+    case IOC_REQ_DEVICE_SIM_TIME:                     /* Simulated device time */
+        DISK_LOCK(disk);
+        memcpy(arg, &disk.sim_ns, sizeof(unsigned long long));
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_SCHED_STATE:                  /* Scheduler seek savings */
+        AIO_LOCK(aio);
+        memcpy(arg, &aio.stat, sizeof(struct ddriver_sched_state));
+        AIO_UNLOCK(aio);
+        break;
+    case IOC_REQ_DEVICE_MAP_IO:                       /* Account a mapped access */
+        map_io = arg;
+        if (map_io->size == 0 || map_io->offset >= disk.layout_size || 
+            map_io->size > disk.layout_size - map_io->offset)
+            return -EINVAL;
+        DISK_LOCK(disk);
+        emulate_delay(emulate_account(fd, map_io->is_write, map_io->offset, map_io->size));
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* TRIM a range */
+        discard = arg;
+        trace_record(DDRIVER_TRACE_DISCARD, discard->offset, discard->size);
+        return emulate_discard(fd, discard->offset, discard->size);
+    case IOC_REQ_DEVICE_XSTATE:                       /* Extended statistics */
+        DISK_LOCK(disk);
+        memcpy(arg, &disk.xstat, sizeof(struct ddriver_xstate));
+        DISK_UNLOCK(disk);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* Barrier: async queue, cache, backing file */
+        trace_record(DDRIVER_TRACE_FLUSH, 0, 0);
+        if (tracef != NULL)
+            fflush(tracef);
+        if (debugf != NULL)
+            fflush(debugf);
+        aio_quiesce();
+        DISK_LOCK(disk);
+        disk.xstat.flush_cnt++;
+        emulate_delay(wcache_flush(fd));
+        DISK_UNLOCK(disk);
+        stat_dump();
+        return stripe_sync();
     default:
         break;
     }
@@ -3,12 +3,165 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
 
+#define DDRIVER_BACKEND_FILE    0       /* read/write后备文件 */
+#define DDRIVER_BACKEND_MMAP    1       /* mmap后备文件 */
+
+/**
+ * @brief 异步请求的完成事件
+ */
+struct ddriver_cqe {
+    void    *priv;                  /* 提交时传入的priv */
+    ssize_t res;                    /* 传输字节数，失败为负值 */
+};
+
+/**
+ * @brief 打开ddriver设备，后端由环境变量DDRIVER_BACKEND选择(file|mmap)，默认file
+ * 
+ * @param path ddriver设备路径
+ * @return int 0成功，否则失败
+ */
 int ddriver_open(char *path);
-int ddriver_seek(int fd, off_t offset, int whence);
+
+/**
+ * @brief 以指定后端打开ddriver设备
+ * 
+ * @param path ddriver设备路径
+ * @param backend DDRIVER_BACKEND_FILE或DDRIVER_BACKEND_MMAP，
+ *                mmap后端在IOC_REQ_DEVICE_FLUSH或关闭设备时才保证落盘
+ * @return int 0成功，否则失败
+ */
+int ddriver_open_backend(char *path, int backend);
+
+/**
+ * @brief 移动ddriver磁盘头
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 移动到的位置，注意要和设备IO单位对齐
+ * @param whence SEEK_SET即可
+ * @return int 0成功，否则失败
+ */
+off_t ddriver_seek(int fd, off_t offset, int whence);
+
+/**
+ * @brief 写入数据
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要等于单次设备IO单位
+ * @return int 0成功，否则失败
+ */
 int ddriver_write(int fd, char *buf, size_t size);
+
+/**
+ * @brief 读出数据
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意一定要等于单次设备IO单位
+ * @return int 
+ */
 int ddriver_read(int fd, char *buf, size_t size);
+
+/**
+ * @brief 定位写入，无需ddriver_seek，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意要是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return ssize_t 写入的字节数，失败返回负值
+ */
+ssize_t ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 定位读出，无需ddriver_seek，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意要是设备IO单位的整数倍
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @return ssize_t 读出的字节数，失败返回负值
+ */
+ssize_t ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 向量写入，一次请求写入从offset开始的多个连续IO单位
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param iov 要写入的数据Buf数组，每一项大小都必须是设备IO单位的整数倍
+ * @param iovcnt iov数组长度
+ * @return ssize_t 写入的字节数，失败返回负值
+ */
+ssize_t ddriver_writev(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 向量读出，一次请求读出从offset开始的多个连续IO单位
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param iov 要读出的数据Buf数组，每一项大小都必须是设备IO单位的整数倍
+ * @param iovcnt iov数组长度
+ * @return ssize_t 读出的字节数，失败返回负值
+ */
+ssize_t ddriver_readv(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 异步写入，立即返回，完成事件通过ddriver_poll_completions获取
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf，完成前不能释放或修改
+ * @param size 要写入的数据大小，注意要是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @param priv 调用方私有数据，原样带回ddriver_cqe
+ * @return int 0成功，队列已满返回-EAGAIN
+ */
+int ddriver_submit_write(int fd, char *buf, size_t size, off_t offset, void *priv);
+
+/**
+ * @brief 异步读出，立即返回，完成事件通过ddriver_poll_completions获取
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf，完成前不能访问
+ * @param size 要读出的数据大小，注意要是设备IO单位的整数倍
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @param priv 调用方私有数据，原样带回ddriver_cqe
+ * @return int 0成功，队列已满返回-EAGAIN
+ */
+int ddriver_submit_read(int fd, char *buf, size_t size, off_t offset, void *priv);
+
+/**
+ * @brief 收割异步请求的完成事件，同时在飞行中的请求完成顺序不确定，
+ *        因此不要同时提交相互重叠的请求。默认的电梯调度(DDRIVER_SCHED)下，
+ *        提交的请求会积攒到调用本函数时才按磁头位置排序服务
+ * 
+ * @param fd ddriver设备handler
+ * @param cqes 完成事件数组
+ * @param max cqes容量
+ * @param min_complete 至少等待的完成数，0表示不等待
+ * @return int 收割到的完成事件个数
+ */
+int ddriver_poll_completions(int fd, struct ddriver_cqe *cqes, int max, int min_complete);
+
+/**
+ * @brief ddriver IO控制。开启写缓存(DDRIVER_WCACHE)时，写入只在IOC_REQ_DEVICE_FLUSH
+ *        或关闭设备后才保证落盘，FLUSH同时等待此前提交的异步请求完成
+ * 
+ * @param fd ddriver设备handler
+ * @param cmd 命令号，查看ddriver_ctl_user，IOC_开头
+ * @param ret 返回值
+ * @return int 0成功，否则失败
+ */
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
+
+/**
+ * @brief 关闭ddriver设备
+ * 
+ * @param fd ddriver设备handler
+ * @return int 0成功，否则失败
+ */
 int ddriver_close(int fd);
 
 #endif /* _DDRIVER_H_ */
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef _DDRIVER_TRACE_H_
+#define _DDRIVER_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * 环境变量DDRIVER_TRACE=<path>时，用户态驱动把每次调用记入该文件：
+ * 一个struct ddriver_trace_hdr，之后是定长的struct ddriver_trace_rec，主机字节序。
+ * ddriver_replay按原API重放这些记录。
+ */
+#define DDRIVER_TRACE_MAGIC     0x52544444      /* "DDTR" */
+#define DDRIVER_TRACE_VERSION   1
+
+enum ddriver_trace_op {
+    DDRIVER_TRACE_SEEK = 0,                 /* ddriver_seek，offset为新磁头位置 */
+    DDRIVER_TRACE_READ,                     /* ddriver_read，offset为调用时的磁头 */
+    DDRIVER_TRACE_WRITE,                    /* ddriver_write */
+    DDRIVER_TRACE_PREAD,                    /* ddriver_pread/readv，size为总长 */
+    DDRIVER_TRACE_PWRITE,                   /* ddriver_pwrite/writev */
+    DDRIVER_TRACE_AREAD,                    /* ddriver_submit_read */
+    DDRIVER_TRACE_AWRITE,                   /* ddriver_submit_write */
+    DDRIVER_TRACE_POLL,                     /* ddriver_poll_completions，offset为max，size为min_complete */
+    DDRIVER_TRACE_DISCARD,                  /* IOC_REQ_DEVICE_DISCARD */
+    DDRIVER_TRACE_FLUSH,                    /* IOC_REQ_DEVICE_FLUSH */
+    DDRIVER_TRACE_RESET,                    /* IOC_REQ_DEVICE_RESET */
+    DDRIVER_TRACE_OPS
+};
+
+struct ddriver_trace_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;                      /* sizeof(struct ddriver_trace_rec) */
+    uint32_t iounit_size;                   /* 录制时的磁盘几何 */
+    uint32_t track_num;
+    uint64_t layout_size;
+};
+
+struct ddriver_trace_rec {
+    uint64_t ts_ns;                         /* 距打开设备的时间(ns)，真实时钟 */
+    uint64_t offset;
+    uint32_t size;
+    uint8_t  op;                            /* enum ddriver_trace_op */
+    uint8_t  pad[3];
+};
+
+#endif /* _DDRIVER_TRACE_H_ */
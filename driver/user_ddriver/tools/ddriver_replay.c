@@ -0,0 +1,274 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include "ddriver.h"
+#include "ddriver_trace.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEVICE_NAME     "ddriver"
+#define POLL_BATCH      64
+#define NS_PER_SEC      (1000000000LL)
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+struct op_stat {
+    unsigned long long cnt;
+    unsigned long long bytes;
+    unsigned long long sim_ns;                      /* Device time charged during the calls */
+    unsigned long long errs;
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+static const char *op_names[DDRIVER_TRACE_OPS] = {
+    "seek", "read", "write", "pread", "pwrite", "aread", "awrite",
+    "poll", "discard", "flush", "reset"
+};
+static struct op_stat stats[DDRIVER_TRACE_OPS];
+static char *wbuf, *rbuf;                           /* Shared payload for synchronous ops */
+static unsigned long long inflight;
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static unsigned long long sim_now(int fd) {
+    unsigned long long ns = 0;
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_SIM_TIME, &ns);
+    return ns;
+}
+
+static const char *fmt_bytes(double val, char *buf, size_t len) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int i = 0;
+    while (val >= 1024 && i < 4) {
+        val /= 1024;
+        i++;
+    }
+    snprintf(buf, len, i ? "%.1f%s" : "%.0f%s", val, units[i]);
+    return buf;
+}
+
+/**
+ * @brief 收割异步完成事件，释放提交时分配的缓冲区
+ */
+static int reap(int fd, int max, int min_complete) {
+    struct ddriver_cqe cqes[POLL_BATCH];
+    int i, n;
+
+    if (max > POLL_BATCH)
+        max = POLL_BATCH;
+    if (min_complete > max)
+        min_complete = max;
+    n = ddriver_poll_completions(fd, cqes, max, min_complete);
+    for (i = 0; i < n; i++) {
+        if (cqes[i].res < 0)
+            stats[DDRIVER_TRACE_POLL].errs++;
+        free(cqes[i].priv);
+    }
+    inflight -= n;
+    return n;
+}
+
+static int submit(int fd, int is_write, size_t size, off_t offset) {
+    char *buf = malloc(size);
+    int ret;
+
+    if (buf == NULL)
+        return -ENOMEM;
+    if (is_write)
+        memset(buf, 0x5a, size);
+    while ((ret = is_write ? ddriver_submit_write(fd, buf, size, offset, buf)
+                           : ddriver_submit_read(fd, buf, size, offset, buf)) == -EAGAIN)
+        reap(fd, POLL_BATCH, 1);                    /* Queue full, make room */
+    if (ret < 0)
+        free(buf);
+    else
+        inflight++;
+    return ret;
+}
+
+/**
+ * @brief 以录制时的API重放一条记录
+ */
+static int replay(int fd, const struct ddriver_trace_rec *rec) {
+    struct ddriver_discard discard;
+    ssize_t ret = 0;
+
+    switch (rec->op) {
+    case DDRIVER_TRACE_SEEK:
+        ret = ddriver_seek(fd, rec->offset, SEEK_SET);
+        break;
+    case DDRIVER_TRACE_READ:
+        ret = ddriver_read(fd, rbuf, rec->size);
+        break;
+    case DDRIVER_TRACE_WRITE:
+        ret = ddriver_write(fd, wbuf, rec->size);
+        break;
+    case DDRIVER_TRACE_PREAD:
+        ret = ddriver_pread(fd, rbuf, rec->size, rec->offset);
+        break;
+    case DDRIVER_TRACE_PWRITE:
+        ret = ddriver_pwrite(fd, wbuf, rec->size, rec->offset);
+        break;
+    case DDRIVER_TRACE_AREAD:
+    case DDRIVER_TRACE_AWRITE:
+        ret = submit(fd, rec->op == DDRIVER_TRACE_AWRITE, rec->size, rec->offset);
+        break;
+    case DDRIVER_TRACE_POLL:
+        reap(fd, rec->offset, rec->size);
+        break;
+    case DDRIVER_TRACE_DISCARD:
+        discard.offset = rec->offset;
+        discard.size = rec->size;
+        ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_DISCARD, &discard);
+        break;
+    case DDRIVER_TRACE_FLUSH:
+        ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+        break;
+    case DDRIVER_TRACE_RESET:
+        ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_RESET, NULL);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return ret < 0 ? (int)ret : 0;
+}
+
+static void report(const char *path, unsigned long long nrec, long long span_ns,
+                   unsigned long long sim_ns, long long wall_ns, int realtime) {
+    unsigned long long reqs = 0, bytes = 0;
+    char b1[32], b2[32];
+    int op;
+
+    printf("trace       %s, %llu records over %.3fs\n", path, nrec, span_ns / 1e9);
+    printf("mode        %s\n", realtime ? "recorded timing" : "as fast as possible (virtual clock)");
+    printf("%-10s %10s %12s %14s %8s\n", "op", "count", "bytes", "sim time(ms)", "errors");
+    for (op = 0; op < DDRIVER_TRACE_OPS; op++) {
+        if (stats[op].cnt == 0)
+            continue;
+        printf("%-10s %10llu %12s %14.3f %8llu\n", op_names[op], stats[op].cnt,
+               fmt_bytes(stats[op].bytes, b1, sizeof(b1)), stats[op].sim_ns / 1e6, stats[op].errs);
+        if (op != DDRIVER_TRACE_SEEK && op != DDRIVER_TRACE_POLL && op != DDRIVER_TRACE_FLUSH &&
+            op != DDRIVER_TRACE_RESET) {
+            reqs += stats[op].cnt;
+            bytes += op == DDRIVER_TRACE_DISCARD ? 0 : stats[op].bytes;
+        }
+    }
+    printf("simulated   %.3fms device time, %.3fms per request\n",
+           sim_ns / 1e6, reqs ? sim_ns / 1e6 / reqs : 0.0);
+    printf("throughput  %s/s simulated, %s/s wall (%.3fs)\n",
+           fmt_bytes(sim_ns ? bytes * 1e9 / sim_ns : 0, b1, sizeof(b1)),
+           fmt_bytes(wall_ns ? bytes * 1e9 / wall_ns : 0, b2, sizeof(b2)), wall_ns / 1e9);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+static void usage(const char *prog) {
+    printf("用法: %s [-r] trace_file\n", prog);
+    printf("  -r          按录制时的时间间隔重放，默认使用虚拟时钟尽快重放\n");
+    printf("  trace_file  DDRIVER_TRACE录制的跟踪文件\n");
+    printf("重放会改写 ~/" DEVICE_NAME " 的内容，调度、缓存等仍由DDRIVER_*环境变量选择\n");
+}
+
+int main(int argc, char **argv) {
+    struct ddriver_trace_hdr hdr;
+    struct ddriver_trace_rec rec;
+    unsigned long long nrec = 0, sim0, sim1, layout = 0;
+    long long start, wait, last_ts = 0;
+    struct timespec ts;
+    char path[256];
+    int opt, fd, io_sz = 0, realtime = 0;
+    FILE *f;
+
+    while ((opt = getopt(argc, argv, "rh")) != -1) {
+        switch (opt) {
+        case 'r':
+            realtime = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != DDRIVER_TRACE_MAGIC ||
+        hdr.version != DDRIVER_TRACE_VERSION || hdr.rec_size != sizeof(rec)) {
+        fprintf(stderr, "%s: not a ddriver trace\n", argv[optind]);
+        fclose(f);
+        return 1;
+    }
+
+    unsetenv("DDRIVER_TRACE");                      /* Don't record the replay itself */
+    if (!realtime)
+        setenv("DDRIVER_CLOCK", "virtual", 1);
+    snprintf(path, sizeof(path), "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
+    fd = ddriver_open(path);
+    if (fd < 0) {
+        fclose(f);
+        return 1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE64, &layout);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &io_sz);
+    if (layout != hdr.layout_size || io_sz != (int)hdr.iounit_size)
+        fprintf(stderr, "warning: trace recorded on %llu bytes / %u io unit, device is %llu / %d\n",
+                (unsigned long long)hdr.layout_size, hdr.iounit_size, layout, io_sz);
+
+    wbuf = malloc(1 << 20);
+    rbuf = malloc(1 << 20);
+    memset(wbuf, 0x5a, 1 << 20);
+    start = now_ns();
+    sim0 = sim_now(fd);
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        nrec++;
+        last_ts = rec.ts_ns;
+        if (rec.op >= DDRIVER_TRACE_OPS) {
+            fprintf(stderr, "record %llu: bad op %d\n", nrec, rec.op);
+            continue;
+        }
+        if (rec.size > (1 << 20) && rec.op != DDRIVER_TRACE_DISCARD &&
+            rec.op != DDRIVER_TRACE_POLL && rec.op != DDRIVER_TRACE_AREAD &&
+            rec.op != DDRIVER_TRACE_AWRITE) {
+            stats[rec.op].errs++;                   /* Larger than the shared payload */
+            continue;
+        }
+        if (realtime && (wait = start + (long long)rec.ts_ns - now_ns()) > 0) {
+            ts.tv_sec = wait / NS_PER_SEC;
+            ts.tv_nsec = wait % NS_PER_SEC;
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        }
+        sim1 = sim_now(fd);
+        if (replay(fd, &rec) < 0)
+            stats[rec.op].errs++;
+        stats[rec.op].cnt++;
+        stats[rec.op].bytes += rec.op == DDRIVER_TRACE_POLL ? 0 : rec.size;
+        stats[rec.op].sim_ns += sim_now(fd) - sim1;
+    }
+    fclose(f);
+    sim1 = sim_now(fd);
+    while (inflight > 0 && reap(fd, POLL_BATCH, 1) > 0);   /* Trace ended with requests in flight */
+    stats[DDRIVER_TRACE_POLL].sim_ns += sim_now(fd) - sim1;
+
+    report(argv[optind], nrec, last_ts, sim_now(fd) - sim0, now_ns() - start, realtime);
+    ddriver_close(fd);
+    free(wbuf);
+    free(rbuf);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include "ddriver_ctl_user.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define KERNEL_DEV_PATH "/dev/ddriver"
+#define USER_STAT_NAME  "ddriver_stat"
+#define HEAT_LEVELS     " .:-=+*#%@"
+#define HIST_WIDTH      40
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief 以人类可读的形式打印字节数
+ */
+static const char *fmt_bytes(unsigned long long bytes, char *buf, size_t len) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double val = bytes;
+    int i = 0;
+    while (val >= 1024 && i < 4) {
+        val /= 1024;
+        i++;
+    }
+    snprintf(buf, len, i ? "%.1f%s" : "%.0f%s", val, units[i]);
+    return buf;
+}
+
+static void print_hist(const char *name, const unsigned long long *hist) {
+    unsigned long long max = 0, total = 0;
+    int i, lo = -1, hi = -1, bar;
+
+    for (i = 0; i < DDRIVER_HIST_BUCKETS; i++) {
+        total += hist[i];
+        max = hist[i] > max ? hist[i] : max;
+        if (hist[i]) {
+            hi = i;
+            if (lo < 0)
+                lo = i;
+        }
+    }
+    printf("%s latency (us), %llu requests:\n", name, total);
+    for (i = lo; i >= 0 && i <= hi; i++) {
+        bar = (int)(hist[i] * HIST_WIDTH / max);
+        printf("  [%8llu, %8llu) %10llu |%.*s\n", i ? 1ULL << i : 0ULL, 1ULL << (i + 1),
+               hist[i], bar, "########################################");
+    }
+}
+
+static void print_heatmap(const struct ddriver_xstate *x) {
+    unsigned long long max = 0;
+    int i, hot = 0, level;
+    char buf[32];
+
+    for (i = 0; i < DDRIVER_HEAT_REGIONS; i++) {
+        if (x->heatmap[i] > max) {
+            max = x->heatmap[i];
+            hot = i;
+        }
+    }
+    printf("heatmap (%s per region, '%s' cold to hot):\n  |",
+           fmt_bytes(x->region_size, buf, sizeof(buf)), HEAT_LEVELS);
+    for (i = 0; i < DDRIVER_HEAT_REGIONS; i++) {
+        level = max ? (int)((x->heatmap[i] * (sizeof(HEAT_LEVELS) - 2) + max - 1) / max) : 0;
+        putchar(HEAT_LEVELS[level]);
+    }
+    printf("|\n");
+    if (max)
+        printf("  hottest region %d at %s: %llu requests\n", hot,
+               fmt_bytes(x->region_size * hot, buf, sizeof(buf)), max);
+}
+
+static void print_stat(const char *src, const struct ddriver_state *state,
+                       const struct ddriver_xstate *x) {
+    unsigned long long reqs = x->seq_cnt + x->rand_cnt;
+    char b1[32], b2[32];
+
+    printf("device      %s\n", src);
+    printf("requests    read %d  write %d  seek %d\n",
+           state->read_cnt, state->write_cnt, state->seek_cnt);
+    printf("bytes       read %s  write %s\n",
+           fmt_bytes(x->read_bytes, b1, sizeof(b1)), fmt_bytes(x->write_bytes, b2, sizeof(b2)));
+    printf("pattern     sequential %llu (%.1f%%)  random %llu\n", x->seq_cnt,
+           reqs ? x->seq_cnt * 100.0 / reqs : 0.0, x->rand_cnt);
+    printf("seek        %s total, %s per random request\n",
+           fmt_bytes(x->seek_dist, b1, sizeof(b1)),
+           fmt_bytes(x->rand_cnt ? x->seek_dist / x->rand_cnt : 0, b2, sizeof(b2)));
+    printf("discarded   %s\n", fmt_bytes(x->discard_bytes, b1, sizeof(b1)));
+    printf("wcache      absorbed %llu  evicted %llu sectors, %llu flushes\n",
+           x->wcache_absorbed, x->wcache_evicted, x->flush_cnt);
+    print_hist("read", x->read_hist);
+    print_hist("write", x->write_hist);
+    print_heatmap(x);
+}
+
+static int load_kernel(struct ddriver_state *state, struct ddriver_xstate *x) {
+    int fd = open(KERNEL_DEV_PATH, O_RDONLY);
+    int ret;
+    if (fd < 0) {
+        perror(KERNEL_DEV_PATH);
+        return -1;
+    }
+    ret = ioctl(fd, IOC_REQ_DEVICE_STATE, state) || ioctl(fd, IOC_REQ_DEVICE_XSTATE, x);
+    close(fd);
+    if (ret)
+        perror("ioctl");
+    return ret ? -1 : 0;
+}
+
+/**
+ * @brief 读取用户态驱动在关闭或FLUSH时导出的统计文件，
+ * 格式为struct ddriver_state紧跟struct ddriver_xstate
+ */
+static int load_user(const char *path, struct ddriver_state *state, struct ddriver_xstate *x) {
+    FILE *f = fopen(path, "r");
+    int ok;
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    ok = fread(state, sizeof(*state), 1, f) == 1 && fread(x, sizeof(*x), 1, f) == 1;
+    fclose(f);
+    if (!ok)
+        fprintf(stderr, "%s: truncated statistics file\n", path);
+    return ok ? 0 : -1;
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+static void usage(const char *prog) {
+    printf("用法: %s [-k] [stat_file]\n", prog);
+    printf("  -k         通过ioctl读取内核模块 %s 的统计\n", KERNEL_DEV_PATH);
+    printf("  stat_file  用户态驱动导出的统计文件，默认 ~/" USER_STAT_NAME "\n");
+}
+
+int main(int argc, char **argv) {
+    struct ddriver_state state;
+    struct ddriver_xstate x;
+    char path[256];
+    int opt, kernel = 0;
+
+    while ((opt = getopt(argc, argv, "kh")) != -1) {
+        switch (opt) {
+        case 'k':
+            kernel = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    memset(&state, 0, sizeof(state));
+    memset(&x, 0, sizeof(x));
+
+    if (kernel) {
+        if (load_kernel(&state, &x) < 0)
+            return 1;
+        print_stat(KERNEL_DEV_PATH, &state, &x);
+        return 0;
+    }
+    if (optind < argc)
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+    else
+        snprintf(path, sizeof(path), "%s/" USER_STAT_NAME, getpwuid(getuid())->pw_dir);
+    if (load_user(path, &state, &x) < 0)
+        return 1;
+    print_stat(path, &state, &x);
+    return 0;
+}
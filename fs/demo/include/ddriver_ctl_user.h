@@ -13,9 +13,55 @@ struct ddriver_state
     int seek_cnt;
 };
 
-#define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
-#define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
-#define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
-#define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+struct ddriver_sched_state
+{
+    unsigned long long reqs;                          /* Async requests dispatched */
+    unsigned long long seek_ns;                       /* Seek time actually charged */
+    unsigned long long fifo_seek_ns;                  /* Seek time in submit order */
+};
+
+#define DDRIVER_HIST_BUCKETS    32                    /* Bucket i: latency in [2^i, 2^(i+1)) us */
+#define DDRIVER_HEAT_REGIONS    64                    /* Disk split into equal regions */
+struct ddriver_xstate
+{
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long seq_cnt;                       /* Starts where the last transfer ended */
+    unsigned long long rand_cnt;
+    unsigned long long seek_dist;                     /* Total head travel in bytes */
+    unsigned long long region_size;                   /* Bytes covered by one heatmap entry */
+    unsigned long long read_hist[DDRIVER_HIST_BUCKETS];
+    unsigned long long write_hist[DDRIVER_HIST_BUCKETS];
+    unsigned long long heatmap[DDRIVER_HEAT_REGIONS]; /* Requests touching each region */
+    unsigned long long discard_bytes;                 /* Bytes released by DISCARD */
+    unsigned long long wcache_absorbed;               /* Sector writes absorbed by the write cache */
+    unsigned long long wcache_evicted;                /* Sectors destaged to make room */
+    unsigned long long flush_cnt;                     /* FLUSH barriers served */
+};
+
+struct ddriver_map_io
+{
+    unsigned long long offset;                        /* Range accessed through mmap */
+    unsigned long long size;
+    int is_write;
+};
+
+struct ddriver_discard
+{
+    unsigned long long offset;                        /* Aligned to the IO unit */
+    unsigned long long size;
+};
+
+#define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
+#define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
+#define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
+#define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 4)                           /* 写屏障：等待异步请求、刷出写缓存并落盘 */
+#define IOC_REQ_DEVICE_SIM_TIME _IOR(IOC_MAGIC, 5, unsigned long long)      /* 请求模拟设备累计耗时(ns) */
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 6, unsigned long long)      /* 请求查看设备大小(64位) */
+#define IOC_REQ_DEVICE_SCHED_STATE _IOR(IOC_MAGIC, 7, struct ddriver_sched_state) /* 请求异步调度的寻道统计，返回 ddriver_sched_state */
+#define IOC_REQ_DEVICE_XSTATE   _IOR(IOC_MAGIC, 8, struct ddriver_xstate)   /* 请求扩展统计，返回 ddriver_xstate */
+#define IOC_REQ_DEVICE_MAP_IO   _IOW(IOC_MAGIC, 9, struct ddriver_map_io)   /* 报告一次映射区访问，计入计数与统计 */
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 10, struct ddriver_discard) /* 请求丢弃一段数据(TRIM)，之后读出全零 */
 
 #endif
\ No newline at end of file
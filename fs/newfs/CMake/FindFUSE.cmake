@@ -1,7 +1,7 @@
    
 # Grab from https://github.com/fntlnz/fuse-example/blob/master/CMake/FindFUSE.cmake
 
-# Find the FUSE includes and library
+# Find the FUSE 3 includes and library
 #
 #  FUSE_INCLUDE_DIR - where to find fuse.h, etc.
 #  FUSE_LIBRARIES   - List of libraries when using FUSE.
@@ -13,17 +13,17 @@ IF (FUSE_INCLUDE_DIR)
 ENDIF (FUSE_INCLUDE_DIR)
 
 # find includes
-FIND_PATH (FUSE_INCLUDE_DIR fuse.h
+FIND_PATH (FUSE_INCLUDE_DIR fuse_lowlevel.h
         /usr/local/include/osxfuse
-        /usr/local/include
-        /usr/include
+        /usr/local/include/fuse3
+        /usr/include/fuse3
         )
 
 # find lib
 if (APPLE)
     SET(FUSE_NAMES libosxfuse.dylib fuse)
 else (APPLE)
-    SET(FUSE_NAMES fuse)
+    SET(FUSE_NAMES fuse3)
 endif (APPLE)
 FIND_LIBRARY(FUSE_LIBRARIES
         NAMES ${FUSE_NAMES}
@@ -31,7 +31,7 @@ FIND_LIBRARY(FUSE_LIBRARIES
         )
 
 include ("FindPackageHandleStandardArgs")
-find_package_handle_standard_args ("FUSE" DEFAULT_MSG
+find_package_handle_standard_args ("FUSE" "FUSE 3 not found, install libfuse3-dev (libfuse-dev is FUSE 2)"
         FUSE_INCLUDE_DIR FUSE_LIBRARIES)
 
 mark_as_advanced (FUSE_INCLUDE_DIR FUSE_LIBRARIES)
\ No newline at end of file
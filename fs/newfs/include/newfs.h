@@ -2,7 +2,7 @@
 #define _NEWFS_H_
 
 #include <stdint.h>
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -13,19 +13,43 @@
 #include "ddriver.h"
 #include "errno.h"
 #include "types.h"
+#include <pthread.h>
 
-#define NEWFS_MAGIC           0x11451419
+#define NEWFS_MAGIC           0x1145141a   /* 布局变化时递增 */
+#define NEWFS_MAGIC_V1        0x11451419   /* sz_disk为int的旧超级块，挂载时原地升级 */
 #define NEWFS_DEFAULT_PERM    0777   /* 全权限打开 */
+#define NEWFS_AIO_DEPTH       32     /* 同时在飞行中的异步块写入数 */
+#define NEWFS_DISCARD_BATCH   64     /* 攒够这么多释放的块再批量通知设备丢弃 */
+#define NEWFS_BCACHE_BLKS     512    /* 块缓存容量(块), 按2Q替换: 1/4给A1in, 另记1/2个淘汰过的块号 */
+#define NEWFS_ICACHE_MEM      (16 * 1024 * 1024) /* inode/目录项缓存的默认内存上限, 可由--cache_mem覆盖 */
+#define NEWFS_DCACHE_SLOTS    1024   /* 路径缓存的槽数(直接映射), 须为2的幂 */
+#define NEWFS_MAX_IO          (128 * 1024) /* 与内核协商的单个读写请求上限 */
+#define NEWFS_ENTRY_TIMEOUT   10.0   /* 低层接口: 内核缓存目录项的秒数, 设备只由本进程修改 */
+#define NEWFS_ATTR_TIMEOUT    10.0   /* 低层接口: 内核缓存属性的秒数 */
+#define NEWFS_DIRTY_MAX       (256 * 1024) /* 未写回数据超过此值时唤醒后台写回, 超过两倍时由写者同步写回 */
+#define NEWFS_DIRTY_EXPIRE_MS 3000   /* 脏inode最长停留时间 */
+#define NEWFS_FLUSH_INTERVAL_MS 500  /* 后台写回线程的唤醒间隔 */
+#define NEWFS_TRACE_RING      4096   /* 每线程跟踪环缓冲区的记录数, 须为2的幂 */
+#define NEWFS_TRACE_FLUSH_MS  100    /* 后台线程写出跟踪记录的间隔 */
+#define NEWFS_TRACE_CRASH_WAIT 50    /* 崩溃时等另一线程写完跟踪记录的毫秒数, 超时则接管 */
+
+/* 日志级别, 编译时以-DNEWFS_LOG_LEVEL=...选择, 高于该级别的日志不会编译进来 */
+#define NEWFS_LOG_ERR         0
+#define NEWFS_LOG_INFO        1
+#define NEWFS_LOG_DEBUG       2
+#ifndef NEWFS_LOG_LEVEL
+#define NEWFS_LOG_LEVEL       NEWFS_LOG_INFO
+#endif
 
 /******************************************************************************
 * SECTION: newfs.c
 *******************************************************************************/
-void* 			   newfs_init(struct fuse_conn_info *);
+void* 			   newfs_init(struct fuse_conn_info *, struct fuse_config *);
 void  			   newfs_destroy(void *);
 int   			   newfs_mkdir(const char *, mode_t);
-int   			   newfs_getattr(const char *, struct stat *);
+int   			   newfs_getattr(const char *, struct stat *, struct fuse_file_info *);
 int   			   newfs_readdir(const char *, void *, fuse_fill_dir_t, off_t,
-						                struct fuse_file_info *);
+						                struct fuse_file_info *, enum fuse_readdir_flags);
 int   			   newfs_mknod(const char *, mode_t, dev_t);
 int   			   newfs_write(const char *, const char *, size_t, off_t,
 					                  struct fuse_file_info *);
@@ -34,35 +58,93 @@ int   			   newfs_read(const char *, char *, size_t, off_t,
 int   			   newfs_access(const char *, int);
 int   			   newfs_unlink(const char *);
 int   			   newfs_rmdir(const char *);
-int   			   newfs_rename(const char *, const char *);
-int   			   newfs_utimens(const char *, const struct timespec tv[2]);
-int   			   newfs_truncate(const char *, off_t);
+int   			   newfs_rename(const char *, const char *, unsigned int);
+int   			   newfs_utimens(const char *, const struct timespec tv[2], struct fuse_file_info *);
+int   			   newfs_truncate(const char *, off_t, struct fuse_file_info *);
 			
+int   			   newfs_fsync(const char *, int, struct fuse_file_info *);
+int   			   newfs_flush(const char *, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
+int   			   newfs_releasedir(const char *, struct fuse_file_info *);
 int   			   newfs_open(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+int                newfs_create(newfs_dentry *, const char *, FILE_TYPE, newfs_dentry **);
+void               newfs_fill_stat(newfs_dentry *, struct stat *);
+int                newfs_resize(newfs_inode *, off_t);
+int                newfs_open_dentry(newfs_dentry *, struct fuse_file_info *, bool);
+void               newfs_close_file(struct fuse_file_info *);
+
+/******************************************************************************
+* SECTION: newfs_ll.c
+*******************************************************************************/
+int                newfs_ll_main(struct fuse_args *);
+void               newfs_notify_inval(newfs_inode *, off_t, off_t);
+int                newfs_notifier_start(struct fuse *);
+void               newfs_notifier_stop(void);
+void               newfs_exit(void);
 
 /******************************************************************************
 * SECTION: newfs_utils.c
 *******************************************************************************/
-#define NEWFS_DEBUG(fmt, ...) do { printf("DEBUG: " fmt, ##__VA_ARGS__); } while(0)
-#define assert(expr) do { if (!(expr)) { NEWFS_DEBUG("assert failed: %s, in %s at %s:%d\n", #expr, __func__, __FILE__, __LINE__); fuse_exit(fuse_get_context()->fuse); exit(-1); } } while(0)
+#define NEWFS_LOG(level, tag, fmt, ...) do { if (level <= NEWFS_LOG_LEVEL) printf(tag ": " fmt, ##__VA_ARGS__); } while(0)
+#define NEWFS_ERR(fmt, ...)   NEWFS_LOG(NEWFS_LOG_ERR, "ERROR", fmt, ##__VA_ARGS__)
+#define NEWFS_INFO(fmt, ...)  NEWFS_LOG(NEWFS_LOG_INFO, "INFO", fmt, ##__VA_ARGS__)
+#define NEWFS_DEBUG(fmt, ...) NEWFS_LOG(NEWFS_LOG_DEBUG, "DEBUG", fmt, ##__VA_ARGS__)
+#define assert(expr) do { if (!(expr)) { NEWFS_ERR("assert failed: %s, in %s at %s:%d\n", #expr, __func__, __FILE__, __LINE__); newfs_trace_flush(); newfs_exit(); exit(-1); } } while(0)
+/* 在FUSE操作开头使用, 持有全局锁直到函数返回 */
+#define NEWFS_GUARD() pthread_mutex_t *_newfs_guard __attribute__((cleanup(newfs_unlock_guard), unused)) = newfs_lock_guard()
 #define safe_strcpy(dst, src, n) do { strncpy(dst, src, n); dst[n-1] = '\0'; } while(0)
 
 int                newfs_driver_read(int, void*);
 int                newfs_driver_read_range(int, void*, int, int);
+int                newfs_driver_read_blocks(int, int, void*);
 int 			   newfs_driver_write(int, void*);
 int 			   newfs_driver_write_range(int, void*, int, int);
+int                newfs_driver_write_blocks(int, int, void*);
+int                newfs_driver_drain(void);
+int                newfs_driver_discard(void);
+
+int                newfs_bcache_init(void);
+int                newfs_bcache_flush(void);
+int                newfs_bcache_sync(int);
+void               newfs_bcache_release(void);
+newfs_buf*         newfs_bread(int);
+newfs_buf*         newfs_bget(int);
+void               newfs_bdirty(newfs_buf*);
+void               newfs_brelse(newfs_buf*);
+void               newfs_bdrop(int);
 
 bool               newfs_test_bit(uint8_t*, int);
 void               newfs_set_bit(uint8_t*, int);
 void               newfs_clear_bit(uint8_t*, int);
+void               newfs_map_dirty(uint8_t*, int, int);
+int                newfs_sync_maps(void);
+void               newfs_map_release(void);
 
 void               newfs_extract_stem(const char*, char*);
 
 newfs_inode*	   newfs_alloc_inode(newfs_dentry*);
 newfs_inode*       newfs_read_inode(int, newfs_dentry*);
 int 			   newfs_sync_inode(newfs_inode*);
+int                newfs_sync_dirty(void);
+int                newfs_sync_file(newfs_inode*, bool);
+void               newfs_balance_dirty(void);
+int                newfs_flusher_start(void);
+void               newfs_flusher_stop(void);
+pthread_mutex_t*   newfs_lock_guard(void);
+void               newfs_unlock_guard(pthread_mutex_t**);
+void               newfs_dirty_inode(newfs_inode*);
+void               newfs_dirty_block(newfs_inode*, int);
 int 			   newfs_unmap_inode(newfs_inode*);
+newfs_dentry*      newfs_dentrys(newfs_inode*);
+newfs_dentry*      newfs_dir_find(newfs_inode*, const char*);
+void               newfs_dir_add(newfs_inode*, newfs_dentry*);
+void               newfs_icache_init(size_t);
+void               newfs_iget(newfs_inode*);
+void               newfs_iput(newfs_inode*);
+void               newfs_touch_inode(newfs_inode*);
+void               newfs_shrink_icache(void);
+newfs_buf*         newfs_file_block(newfs_inode*, int, bool);
 
 int   		       newfs_alloc_block(void);
 int    		       newfs_free_block(int);
@@ -70,5 +152,24 @@ int    		       newfs_free_block(int);
 newfs_dentry*      newfs_make_dentry(const char*, FILE_TYPE);
 
 newfs_dentry*      newfs_lookup(const char*, newfs_dentry*, bool);
+void               newfs_dcache_forget(const char*);
+void               newfs_dcache_release(void);
+
+/******************************************************************************
+* SECTION: newfs_trace.c
+*******************************************************************************/
+/* 热路径上的事件写入每线程环缓冲区, 由后台线程写出; -DNEWFS_NO_TRACE时完全编译掉 */
+#ifdef NEWFS_NO_TRACE
+#define NEWFS_TRACE(event, a, b, s) do { } while(0)
+#else
+#define NEWFS_TRACE(event, a, b, s) do { if (newfs_trace_on) newfs_trace_emit(event, a, b, s); } while(0)
+#endif
+
+extern bool        newfs_trace_on;
+
+int                newfs_trace_init(const char*);
+void               newfs_trace_emit(int, int64_t, int64_t, const char*);
+void               newfs_trace_flush(void);
+void               newfs_trace_stop(void);
 
 #endif  /* _newfs_H_ */
@@ -14,8 +14,49 @@ typedef enum file_type {
 
 struct custom_options {
 	const char*        device;
+	const char*        trace;      // 事件跟踪文件, 为空时不跟踪
+	const char*        cache_mem;  // inode/目录项缓存的内存上限, 如64M
+	int                lowlevel;   // 非零时使用按inode号的低层FUSE接口
 };
 
+typedef enum newfs_trace_event {
+    TRACE_DROPPED,      // a: 环缓冲区满时丢弃的事件数
+    TRACE_LOOKUP,       // s: 路径, a: 起始inode
+    TRACE_ALLOC_BLOCK,  // a: 块号
+    TRACE_FREE_BLOCK,   // a: 块号
+    TRACE_ALLOC_INODE,  // s: 文件名, a: inode号
+    TRACE_SYNC_INODE,   // s: 文件名, a: inode号
+    TRACE_READDIR_SKIP, // s: 文件名, a: 目录项序号
+    TRACE_MKDIR,        // s: 路径, a: inode号
+    TRACE_MKNOD,        // s: 路径, a: inode号
+    TRACE_READ,         // s: 路径, a: 偏移, b: 长度
+    TRACE_WRITE,        // s: 路径, a: 偏移, b: 长度
+    TRACE_EVICT,        // s: 文件名, a: inode号, b: 释放的字节数
+    NEWFS_TRACE_EVENT_NUM
+} NEWFS_TRACE_EVENT;
+
+#define NEWFS_TRACE_MAGIC   0x5254464e  /* "NFTR" */
+#define NEWFS_TRACE_STR     24          /* 记录中字符串参数的长度, 超长截断 */
+#define NEWFS_TRACE_FMT_LEN 64          /* 文件头中每个事件格式串的长度 */
+
+typedef struct newfs_trace_hdr {
+    uint32_t magic;
+    uint16_t rec_size;    // sizeof(newfs_trace_rec)
+    uint16_t nevents;     // 之后跟着nevents个fmt_len字节的格式串, 再之后是记录
+    uint16_t fmt_len;
+    uint16_t pad[3];
+} newfs_trace_hdr;
+
+typedef struct newfs_trace_rec {
+    uint64_t ts_ns;       // CLOCK_MONOTONIC时间戳
+    uint32_t tid;         // 产生事件的线程
+    uint16_t event;       // NEWFS_TRACE_EVENT
+    uint16_t pad;
+    int64_t  a;
+    int64_t  b;
+    char     s[NEWFS_TRACE_STR];
+} newfs_trace_rec;
+
 typedef struct newfs_inode_d {
     uint32_t  ino;         // inode号
 
@@ -33,11 +74,23 @@ typedef struct newfs_inode {
     int       link;        // 链接数
     FILE_TYPE ftype;       // 文件类型
 
-    int       direct[MAX_IDX_NUM]; // 直接索引(数据块号, 0表示未分配)
+    int       direct[MAX_IDX_NUM]; // 直接索引(数据块号, 0表示未分配, 普通文件可以有空洞)
 
-    uint8_t*  data[MAX_IDX_NUM];   // 数据
     struct newfs_dentry* dentry;   // 此结点对应的目录项
-    struct newfs_dentry* dentrys;  // 目录项(仅当为目录文件时有效, 且必定会被加载)
+    struct newfs_dentry* dentrys;  // 目录项(仅当为目录文件时有效, 首次访问时由newfs_dentrys加载)
+    bool      dentrys_loaded;
+    struct newfs_dentry** htab;    // 目录项按名字哈希的索引, 与dentrys同步维护
+    uint32_t  hsize;               // 桶数, 2的幂
+    uint32_t  hcount;
+
+    bool      dirty;       // 大小、索引等元数据需要写回
+    uint8_t   dirty_blks;  // 需要写回的目录项块, 第i位对应direct[i]; 文件数据的脏位在块缓存中
+    struct newfs_inode* dirty_next; // 脏inode链表, 由newfs_sync_dirty逐个写回
+    uint64_t  dirty_since; // 进入脏链表的时间(ms), 后台线程据此按时写回
+
+    int       ref;         // 引用计数, 非零时不会被淘汰
+    struct newfs_inode* lru_prev;   // 已加载inode的LRU链表, 表头最近使用
+    struct newfs_inode* lru_next;
 } newfs_inode;
 
 typedef struct newfs_dentry_d {
@@ -54,13 +107,39 @@ typedef struct newfs_dentry {
     struct newfs_dentry* parent;  // 父目录
     struct newfs_dentry* next;    // 父目录下一个dentry
     struct newfs_inode*  inode;   // inode(可以为NULL表示未加载)
+    uint32_t  hash;               // 名字的哈希
+    struct newfs_dentry* hnext;   // 父目录索引中的哈希链
 } newfs_dentry;
 
+/// open/opendir放入fi->fh, 数据操作不再按路径查找
+typedef struct newfs_file {
+    struct newfs_dentry* dentry;  // 打开时解析的dentry
+    struct newfs_inode*  inode;   // 打开期间持有引用, 不会被淘汰
+} newfs_file;
+
+typedef enum newfs_buf_queue {
+    BUF_FREE,      // 未使用
+    BUF_A1IN,      // 首次访问, FIFO
+    BUF_AM         // 再次访问, LRU
+} NEWFS_BUF_QUEUE;
+
+typedef struct newfs_buf {
+    int       blkno;      // 逻辑块号
+    uint8_t*  data;       // 指向缓冲池中的一块
+    bool      dirty;      // 内容比磁盘新, 淘汰或刷出时写回
+    int       pin;        // 引用计数, 非零时不可淘汰
+    NEWFS_BUF_QUEUE queue;
+
+    struct newfs_buf* prev;   // 所在队列
+    struct newfs_buf* next;
+    struct newfs_buf* hnext;  // 哈希链
+} newfs_buf;
+
 struct newfs_super {
     uint32_t magic;
     
     int      sz_io;     // IO块大小
-    int      sz_disk;   // 磁盘大小
+    int64_t  sz_disk;   // 磁盘大小(可超过2GiB)
     int      sz_block;  // 逻辑块大小
     int      tot_block; // 逻辑块总数
 
@@ -87,4 +166,25 @@ struct newfs_super {
     bool         is_mounted; // 是否已挂载
 };
 
+/// NEWFS_MAGIC_V1的磁盘超级块: 只有sz_disk是int, 其余磁盘结构与现在相同
+struct newfs_super_v1 {
+    uint32_t magic;
+    int      sz_io;
+    int      sz_disk;
+    int      sz_block;
+    int      tot_block;
+    int      imap_off;
+    int      imap_blks;
+    int      dmap_off;
+    int      dmap_blks;
+    int      ino_off;
+    int      ino_per_block;
+    int      den_per_block;
+    int      ino_blks;
+    int      ino_num;
+    int      data_off;
+    int      data_blks;
+    int      root_ino;
+};
+
 #endif /* _TYPES_H_ */
@@ -3,6 +3,7 @@
 #define _XOPEN_SOURCE 700
 
 #include "newfs.h"
+#include <fuse_lowlevel.h>
 
 /******************************************************************************
 * SECTION: 宏定义
@@ -14,6 +15,9 @@
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--trace=%s", trace),
+	OPTION("--cache_mem=%s", cache_mem),
+	OPTION("--lowlevel", lowlevel),
 	FUSE_OPT_END
 };
 
@@ -37,65 +41,289 @@ static struct fuse_operations operations = {
 	.rmdir	= NULL,							  		 /* 删除目录， rm -r */
 	.rename = NULL,							  		 /* 重命名，mv */
 
-	.open = NULL,							
-	.opendir = NULL,
+	.fsync = newfs_fsync,					 /* 写回单个文件并落盘 */
+	.flush = newfs_flush,					 /* close时写回该文件 */
+	.release = newfs_release,				 /* 最后一次close */
+
+	.open = newfs_open,						 /* 解析路径，结果放入fi->fh */
+	.opendir = newfs_opendir,
+	.releasedir = newfs_releasedir,
 	.access = NULL
 };
 /******************************************************************************
+* SECTION: 辅助函数
+*******************************************************************************/
+/**
+ * @brief 解析带K/M/G后缀的大小，如64M
+ */
+static size_t parse_size(const char* str) {
+	char *end;
+	size_t sz = strtoull(str, &end, 10);
+	switch(*end) {
+	case 'G': case 'g': sz <<= 10; /* fall through */
+	case 'M': case 'm': sz <<= 10; /* fall through */
+	case 'K': case 'k': sz <<= 10; break;
+	default: break;
+	}
+	return sz;
+}
+/**
+ * @brief 在目录t下创建名为name的文件或目录，两种前端共用
+ * 
+ * @param out 非NULL时返回新的dentry
+ * @return int 0成功，否则失败
+ */
+int newfs_create(newfs_dentry* t, const char* name, FILE_TYPE ftype, newfs_dentry** out) {
+	if(t->ftype != DIR) {
+		return -ENOTDIR;
+	}
+	if(t->inode == NULL) {
+		t->inode = newfs_read_inode(t->ino, t);
+		assert(t->inode);
+	}
+	if(strcmp(name, "") == 0) {
+		return -EEXIST;
+	}
+	if(newfs_dir_find(t->inode, name)) {
+		return -EEXIST;
+	}
+	if(t->inode->size / sizeof(newfs_dentry_d) >= MAX_IDX_NUM * super.den_per_block) {
+		return -ENOSPC;
+	}
+
+	newfs_dentry *den = newfs_make_dentry(name, ftype);
+	den->inode = newfs_alloc_inode(den);
+	den->inode->ftype = ftype;
+	den->inode->link = 1;
+	den->ino = den->inode->ino;
+	newfs_dirty_inode(den->inode);
+	NEWFS_TRACE(ftype == DIR ? TRACE_MKDIR : TRACE_MKNOD, den->ino, 0, name);
+
+	t->inode->size += sizeof(newfs_dentry_d);
+	newfs_dir_add(t->inode, den);
+	newfs_dirty_inode(t->inode);
+	newfs_dirty_block(t->inode, (t->inode->size / sizeof(newfs_dentry_d) - 1) / super.den_per_block);
+	newfs_balance_dirty();
+	if(out) {
+		*out = den;
+	}
+	return 0;
+}
+
+/**
+ * @brief 填写t的属性，两种前端共用
+ */
+void newfs_fill_stat(newfs_dentry* t, struct stat* newfs_stat) {
+	if(t->inode == NULL) {
+		t->inode = newfs_read_inode(t->ino, t);
+		assert(t->inode);
+	}
+
+	if(t->ftype == DIR) {
+		newfs_stat->st_mode = S_IFDIR | 0777;
+	} else {
+		newfs_stat->st_mode = S_IFREG | 0777;
+	}
+
+	if(t == super.root->dentry) {
+		newfs_stat->st_nlink = 2;
+	} else {
+		newfs_stat->st_nlink = 1;
+	}
+
+	newfs_stat->st_ino = t->ino;
+	newfs_stat->st_size = t->inode->size;
+	newfs_stat->st_uid = getuid();
+	newfs_stat->st_gid = getgid();
+	newfs_stat->st_blksize = super.sz_block;
+	newfs_stat->st_blocks = (t->inode->size + super.sz_block - 1) / super.sz_block;
+	newfs_stat->st_atime = time(NULL);
+	newfs_stat->st_mtime = time(NULL);
+}
+
+/**
+ * @brief 把文件u的大小改为offset，两种前端共用
+ */
+int newfs_resize(newfs_inode* u, off_t offset) {
+	if(offset > (off_t)MAX_IDX_NUM * super.sz_block) {
+		return -EFBIG;
+	}
+
+	// growing leaves a hole that reads as zeros; shrinking frees the blocks past the end
+	int new_cnt = (offset + super.sz_block - 1) / super.sz_block;
+	for(int i=new_cnt; i<MAX_IDX_NUM; ++i) {
+		if(u->direct[i]) {
+			newfs_free_block(u->direct[i]);
+			u->direct[i] = 0;
+		}
+	}
+	int tail = offset % super.sz_block;
+	if(offset < u->size && tail && u->direct[new_cnt - 1]) {
+		// so that growing the file again reads zeros there
+		newfs_buf *b = newfs_bread(u->direct[new_cnt - 1]);
+		assert(b);
+		memset(b->data + tail, 0, super.sz_block - tail);
+		newfs_bdirty(b);
+		newfs_brelse(b);
+	}
+	if(u->size != offset) {
+		newfs_dirty_inode(u);
+		// 内核缓存的旧页从较小的那个大小起不再有效
+		newfs_notify_inval(u, offset < u->size ? offset : u->size, 0);
+	}
+	u->size = offset;
+	return 0;
+}
+
+/**
+ * @brief 取得操作的目标：已打开时用fi->fh中的dentry，否则按路径查找
+ */
+static newfs_dentry* file_dentry(const char* path, struct fuse_file_info* fi) {
+	if(fi && fi->fh) {
+		return ((newfs_file*)(uintptr_t)fi->fh)->dentry;
+	}
+	return newfs_lookup(path, super.root->dentry, false);
+}
+
+/**
+ * @brief open/opendir共用：加载并持有t的inode，放入fi->fh
+ */
+int newfs_open_dentry(newfs_dentry* t, struct fuse_file_info* fi, bool dir) {
+	if(t == NULL) {
+		return -ENOENT;
+	}
+	if(dir && t->ftype != DIR) {
+		return -ENOTDIR;
+	}
+	if(!dir && t->ftype != REG) {
+		return -EISDIR;
+	}
+	if(t->inode == NULL) {
+		t->inode = newfs_read_inode(t->ino, t);
+		assert(t->inode);
+	}
+	newfs_file *f = malloc(sizeof(newfs_file));
+	if(f == NULL) {
+		return -ENOMEM;
+	}
+	f->dentry = t;
+	f->inode = t->inode;
+	newfs_iget(f->inode);
+	fi->fh = (uintptr_t)f;
+	/* 页缓存跨open保留：在内核背后改变的内容都由通知线程作废 */
+	fi->keep_cache = !dir;
+	return 0;
+}
+
+/**
+ * @brief release/releasedir共用：放开inode，之后它可以被淘汰
+ */
+void newfs_close_file(struct fuse_file_info* fi) {
+	newfs_file *f = (newfs_file*)(uintptr_t)fi->fh;
+	if(f) {
+		newfs_iput(f->inode);
+		free(f);
+		fi->fh = 0;
+	}
+}
+/**
+ * @brief 原地升级NEWFS_MAGIC_V1的超级块：sz_disk加宽为int64_t后其后各字段后移，
+ * 位图、inode与目录项的布局没有变，只需按旧布局取出字段。新布局在卸载时写回，
+ * 此前崩溃的话下次挂载会再升级一次
+ */
+static void upgrade_super_v1(void) {
+	struct newfs_super_v1 old;
+
+	memcpy(&old, &super, sizeof(old));
+	NEWFS_INFO("upgrading newfs superblock from magic %#x\n", old.magic);
+	super.magic = NEWFS_MAGIC;
+	super.sz_io = old.sz_io; super.sz_disk = old.sz_disk;
+	super.sz_block = old.sz_block; super.tot_block = old.tot_block;
+	super.imap_off = old.imap_off; super.imap_blks = old.imap_blks;
+	super.dmap_off = old.dmap_off; super.dmap_blks = old.dmap_blks;
+	super.ino_off = old.ino_off; super.ino_per_block = old.ino_per_block;
+	super.den_per_block = old.den_per_block; super.ino_blks = old.ino_blks;
+	super.ino_num = old.ino_num; super.data_off = old.data_off;
+	super.data_blks = old.data_blks; super.root_ino = old.root_ino;
+}
+/******************************************************************************
 * SECTION: 必做函数实现
 *******************************************************************************/
 /**
  * @brief 挂载（mount）文件系统
  * 
- * @param conn_info 可忽略，一些建立连接相关的信息 
+ * @param conn_info 连接信息，在这里协商写回缓存和请求大小
+ * @param cfg 高层接口的配置，低层接口传入NULL
  * @return void*
  */
-void* newfs_init(struct fuse_conn_info * conn_info)
+void* newfs_init(struct fuse_conn_info * conn_info, struct fuse_config * cfg)
 {
+	NEWFS_GUARD();
+	if(conn_info) {
+		// 小写入先在内核页缓存中合并，再以大请求写下来
+		if(conn_info->capable & FUSE_CAP_WRITEBACK_CACHE) {
+			conn_info->want |= FUSE_CAP_WRITEBACK_CACHE;
+		}
+		conn_info->max_write = NEWFS_MAX_IO;
+		conn_info->max_read = NEWFS_MAX_IO;
+		conn_info->max_readahead = NEWFS_MAX_IO;
+	}
+	if(cfg) {
+		cfg->entry_timeout = NEWFS_ENTRY_TIMEOUT;
+		cfg->negative_timeout = NEWFS_ENTRY_TIMEOUT;
+		cfg->attr_timeout = NEWFS_ATTR_TIMEOUT;
+	}
 	int fd = ddriver_open((char*)newfs_options.device);
 	assert(fd > 0);
+	newfs_trace_init(newfs_options.trace ? newfs_options.trace : getenv("NEWFS_TRACE"));
+	newfs_icache_init(newfs_options.cache_mem ? parse_size(newfs_options.cache_mem) : NEWFS_ICACHE_MEM);
 
-	int sz_io=0, sz_disk=0, io_per_block=2;
+	int sz_io=0, io_per_block=2;
+	unsigned long long sz_disk=0;
 	assert(ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &sz_io) == 0);
-    assert(ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE, &sz_disk) == 0);
+	assert(ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE64, &sz_disk) == 0);
 
 	super.fd = fd; super.sz_io = sz_io; super.sz_disk = sz_disk;
 	super.io_per_block = io_per_block; super.sz_block = sz_io * io_per_block;
+	assert(newfs_bcache_init() == 0);
 	assert(newfs_driver_read_range(0, &super, 0, sizeof(super)) == 0);
+	if(super.magic == NEWFS_MAGIC_V1) {
+		upgrade_super_v1();
+	}
 
 	super.fd = fd; super.sz_io = sz_io; super.sz_disk = sz_disk;
 	super.io_per_block = io_per_block; super.sz_block = sz_io * io_per_block;
 
-	assert(super.imap = malloc(super.sz_block));
-	assert(super.dmap = malloc(super.sz_block));
 	super.is_mounted = true;
 
 	newfs_dentry *root_dentry = newfs_make_dentry("/", DIR);
 	if(super.magic != NEWFS_MAGIC) {
 		// build
-		NEWFS_DEBUG("building newfs\n");
+		NEWFS_INFO("building newfs\n");
 		super.magic = NEWFS_MAGIC;
 
 		super.sz_block = super.sz_io * super.io_per_block;
 		super.tot_block = super.sz_disk / super.sz_block;
 
-		super.imap_off = 1;
-		super.imap_blks = 1;
-		super.dmap_off = super.imap_off + super.imap_blks;
-		super.dmap_blks = 1;
-		
-		super.ino_off = super.dmap_off + super.dmap_blks;
 		super.ino_per_block = super.sz_block / sizeof(struct newfs_inode_d);
 		super.ino_blks = (super.tot_block + super.ino_per_block - 1) / super.ino_per_block;
 		super.den_per_block = super.sz_block / sizeof(struct newfs_dentry_d);
 		super.ino_num = super.ino_per_block * super.ino_blks;
 
+		// 位图按容量向上取整到块，数据块位图以总块数为上界
+		int bits_per_block = super.sz_block * 8;
+		super.imap_off = 1;
+		super.imap_blks = (super.ino_num + bits_per_block - 1) / bits_per_block;
+		super.dmap_off = super.imap_off + super.imap_blks;
+		super.dmap_blks = (super.tot_block + bits_per_block - 1) / bits_per_block;
+		
+		super.ino_off = super.dmap_off + super.dmap_blks;
 
 		super.data_off = super.ino_off + super.ino_blks;
 		super.data_blks = super.tot_block - super.data_off;
 
-		memset(super.imap, 0, super.sz_block);
-		memset(super.dmap, 0, super.sz_block);
+		assert(super.imap = calloc(super.imap_blks, super.sz_block));
+		assert(super.dmap = calloc(super.dmap_blks, super.sz_block));
 
 		// allocate root
 		assert(super.root = newfs_alloc_inode(root_dentry));
@@ -103,17 +331,30 @@ void* newfs_init(struct fuse_conn_info * conn_info)
 		super.root->dentry = root_dentry;
 
 		super.root_ino = super.root->ino;
-		assert(newfs_sync_inode(super.root) == 0);
+		// 新建的位图与超级块都要经过缓存写下去，否则fsync过的文件在崩溃后无处可寻
+		for(int i = 0; i < super.imap_blks; i++) {
+			newfs_map_dirty(super.imap, super.imap_off, i * bits_per_block);
+		}
+		for(int i = 0; i < super.dmap_blks; i++) {
+			newfs_map_dirty(super.dmap, super.dmap_off, i * bits_per_block);
+		}
+		assert(newfs_driver_write_range(0, &super, 0, sizeof(super)) == 0);
+		newfs_dirty_inode(super.root);
+		assert(newfs_sync_dirty() == 0);
+		assert(newfs_bcache_flush() == 0);
 	} else {
 		// load
-		NEWFS_DEBUG("loading existing newfs\n");
-		assert(newfs_driver_read(super.imap_off, super.imap) == 0);
-		assert(newfs_driver_read(super.dmap_off, super.dmap) == 0);
+		NEWFS_INFO("loading existing newfs\n");
+		assert(super.imap = malloc(super.imap_blks * super.sz_block));
+		assert(super.dmap = malloc(super.dmap_blks * super.sz_block));
+		assert(newfs_driver_read_blocks(super.imap_off, super.imap_blks, super.imap) == 0);
+		assert(newfs_driver_read_blocks(super.dmap_off, super.dmap_blks, super.dmap) == 0);
 
 		assert(super.root = newfs_read_inode(super.root_ino, root_dentry));
 	}
 
 	NEWFS_DEBUG("imap_blks %d, dmap_blks %d, ino_blks %d\n", super.imap_blks, super.dmap_blks, super.ino_blks);
+	assert(newfs_flusher_start() == 0);
 	return NULL;
 }
 
@@ -125,20 +366,32 @@ void* newfs_init(struct fuse_conn_info * conn_info)
  */
 void newfs_destroy(void* p)
 {
+	newfs_flusher_stop();
+	NEWFS_GUARD();
 	assert(super.is_mounted);
 
-	assert(newfs_sync_inode(super.root) == 0);
+	assert(newfs_sync_dirty() == 0);
+	assert(newfs_bcache_flush() == 0);
+	assert(newfs_driver_discard() == 0);
+	newfs_dcache_release();
 	assert(newfs_unmap_inode(super.root) == 0); super.root = NULL;
 
-	assert(newfs_driver_write(super.imap_off, super.imap) == 0);
+	assert(newfs_driver_write_blocks(super.imap_off, super.imap_blks, super.imap) == 0);
 	free(super.imap); super.imap = NULL;
-	assert(newfs_driver_write(super.dmap_off, super.dmap) == 0);
+	assert(newfs_driver_write_blocks(super.dmap_off, super.dmap_blks, super.dmap) == 0);
 	free(super.dmap); super.dmap = NULL;
+	newfs_map_release();
 
+	/* Barrier: everything above is durable before the superblock marks the volume clean */
+	assert(ddriver_ioctl(super.fd, IOC_REQ_DEVICE_FLUSH, NULL) == 0);
 	super.is_mounted = false;
 	assert(newfs_driver_write_range(0, &super, 0, sizeof(super)) == 0);
+	assert(newfs_bcache_flush() == 0);
+	assert(ddriver_ioctl(super.fd, IOC_REQ_DEVICE_FLUSH, NULL) == 0);
 
 	ddriver_close(super.fd);
+	newfs_bcache_release();
+	newfs_trace_stop();
 	return;
 }
 
@@ -150,39 +403,18 @@ void newfs_destroy(void* p)
  * @return int 0成功，否则失败
  */
 int newfs_mkdir(const char* path, mode_t mode) {
+	NEWFS_GUARD();
 	newfs_dentry *t = newfs_lookup(path, super.root->dentry, true);
 	if(t == NULL) {
 		return -ENOENT;
 	}
-	if(t->ftype != DIR) {
-		return -ENOTDIR;
-	}
-	if(t->inode == NULL) {
-		t->inode = newfs_read_inode(t->ino, t);
-		assert(t->inode);
-	}
-
 	char name[MAX_NAME_LEN];
 	newfs_extract_stem(path, name);
-	if(strcmp(name, "") == 0) {
-		return -EEXIST;
+	int ret = newfs_create(t, name, DIR, NULL);
+	if(ret == 0) {
+		newfs_dcache_forget(path); // may be cached as ENOENT
 	}
-	for(newfs_dentry *d=t->inode->dentrys; d; d=d->next) {
-		if(strcmp(d->name, name) == 0) {
-			return -EEXIST;
-		}
-	}
-
-	newfs_dentry *den = newfs_make_dentry(name, DIR);
-	den->inode = newfs_alloc_inode(den);
-	den->ino = den->inode->ino;
-	NEWFS_DEBUG("mkdir %s using inode %d\n", den->name, den->ino);
-
-	t->inode->size += sizeof(newfs_dentry_d);
-	den->parent = t;
-	den->next = t->inode->dentrys;
-	t->inode->dentrys = den;
-	return 0;
+	return ret;
 }
 
 /**
@@ -190,38 +422,16 @@ int newfs_mkdir(const char* path, mode_t mode) {
  * 
  * @param path 相对于挂载点的路径
  * @param newfs_stat 返回状态
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
  * @return int 0成功，否则失败
  */
-int newfs_getattr(const char* path, struct stat * newfs_stat) {
-	newfs_dentry *t = newfs_lookup(path, super.root->dentry, false);
+int newfs_getattr(const char* path, struct stat * newfs_stat, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_dentry *t = file_dentry(path, fi);
 	if(t == NULL) {
 		return -ENOENT;
 	}
-
-	if(t->inode == NULL) {
-		t->inode = newfs_read_inode(t->ino, t);
-		assert(t->inode);
-	}
-
-	if(t->ftype == DIR) {
-		newfs_stat->st_mode = S_IFDIR | 0777;
-	} else {
-		newfs_stat->st_mode = S_IFREG | 0777;
-	}
-
-	if(t == super.root->dentry) {
-		newfs_stat->st_nlink = 2;
-	} else {
-		newfs_stat->st_nlink = 1;
-	}
-
-	newfs_stat->st_size = t->inode->size;
-	newfs_stat->st_uid = getuid();
-	newfs_stat->st_gid = getgid();
-	newfs_stat->st_blksize = super.sz_block;
-	newfs_stat->st_blocks = (t->inode->size + super.sz_block - 1) / super.sz_block;
-	newfs_stat->st_atime = time(NULL);
-	newfs_stat->st_mtime = time(NULL);
+	newfs_fill_stat(t, newfs_stat);
 	return 0;
 }
 
@@ -233,19 +443,23 @@ int newfs_getattr(const char* path, struct stat * newfs_stat) {
  * @param filler 参数讲解:
  * 
  * typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
- *				const struct stat *stbuf, off_t off)
+ *				const struct stat *stbuf, off_t off,
+ *				enum fuse_fill_dir_flags flags)
  * buf: name会被复制到buf中
  * name: dentry名字
  * stbuf: 文件状态，可忽略
  * off: 下一次offset从哪里开始，这里可以理解为第几个dentry
+ * flags: 不带FUSE_FILL_DIR_PLUS，即stbuf中没有完整属性
  * 
  * @param offset 第几个目录项？
- * @param fi 可忽略
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
+ * @param flags FUSE_READDIR_PLUS时可以同时返回属性，这里忽略
  * @return int 0成功，否则失败
  */
 int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t offset,
-			    		 struct fuse_file_info * fi) {
-	newfs_dentry *t = newfs_lookup(path, super.root->dentry, false);
+			    		 struct fuse_file_info * fi, enum fuse_readdir_flags flags) {
+	NEWFS_GUARD();
+	newfs_dentry *t = file_dentry(path, fi);
 	if(t == NULL) {
 		return -ENOENT;
 	}
@@ -257,13 +471,13 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 		assert(t->inode);
 	}
 
-	newfs_dentry *d = t->inode->dentrys;
+	newfs_dentry *d = newfs_dentrys(t->inode);
 	for(int i=0; i<offset && d; d=d->next, ++i) {
-		NEWFS_DEBUG("skip %d %s\n", i, d->name);
+		NEWFS_TRACE(TRACE_READDIR_SKIP, i, 0, d->name);
 	}
 
 	for(int i=offset; d; d=d->next, ++i) {
-		if(filler(buf, d->name, NULL, i+1) != 0) {
+		if(filler(buf, d->name, NULL, i+1, 0) != 0) {
 			return 0; // buffer full
 		}
 	}
@@ -279,39 +493,18 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
  * @return int 0成功，否则失败
  */
 int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
+	NEWFS_GUARD();
 	newfs_dentry *t = newfs_lookup(path, super.root->dentry, true);
 	if(t == NULL) {
 		return -ENOENT;
 	}
-	if(t->ftype != DIR) {
-		return -ENOTDIR;
-	}
-	if(t->inode == NULL) {
-		t->inode = newfs_read_inode(t->ino, t);
-		assert(t->inode);
-	}
-
 	char name[MAX_NAME_LEN];
 	newfs_extract_stem(path, name);
-	if(strcmp(name, "") == 0) {
-		return -EEXIST;
-	}
-	for(newfs_dentry *d=t->inode->dentrys; d; d=d->next) {
-		if(strcmp(d->name, name) == 0) {
-			return -EEXIST;
-		}
+	int ret = newfs_create(t, name, REG, NULL);
+	if(ret == 0) {
+		newfs_dcache_forget(path); // may be cached as ENOENT
 	}
-
-	newfs_dentry *den = newfs_make_dentry(name, REG);
-	den->inode = newfs_alloc_inode(den);
-	den->ino = den->inode->ino;
-	NEWFS_DEBUG("mknod %s using inode %d\n", den->name, den->ino);
-
-	t->inode->size += sizeof(newfs_dentry_d);
-	den->parent = t;
-	den->next = t->inode->dentrys;
-	t->inode->dentrys = den;
-	return 0;
+	return ret;
 }
 
 /**
@@ -319,9 +512,10 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
  * 
  * @param path 相对于挂载点的路径
  * @param tv 实践
+ * @param fi 可忽略
  * @return int 0成功，否则失败
  */
-int newfs_utimens(const char* path, const struct timespec tv[2]) {
+int newfs_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
 	(void)path;
 	return 0;
 }
@@ -335,15 +529,16 @@ int newfs_utimens(const char* path, const struct timespec tv[2]) {
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
  * @return int 写入大小
  */
 int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
+	NEWFS_GUARD();
 	if(size == 0) {
 		return 0;
 	}
-	newfs_dentry *t = newfs_lookup(path, super.root->dentry, false);
+	newfs_dentry *t = file_dentry(path, fi);
 	if(t == NULL) {
 		return -ENOENT;
 	}
@@ -354,10 +549,11 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		t->inode = newfs_read_inode(t->ino, t);
 		assert(t->inode);
 	}
-
-	int newsize = t->inode->size;
-	newsize = newsize > offset + size ? newsize : offset + size;
-	newfs_truncate(path, newsize);
+	NEWFS_TRACE(TRACE_WRITE, offset, size, path);
+	if(offset + size > (off_t)MAX_IDX_NUM * super.sz_block) {
+		newfs_notify_inval(t->inode, offset, size);
+		return -EFBIG;
+	}
 
 	int cnt = 0; // bytes written
 	for(int i=0; i<MAX_IDX_NUM; ++i) {
@@ -365,16 +561,30 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		if(offset + size <= p1) {
 			break;
 		}
-		assert(t->inode->data[i]);
 		if(offset >= p2) {
 			continue;
 		}
 		int begin = offset > p1 ? offset : p1;
 		int end = offset + size < p2 ? offset + size : p2;
-		memcpy(t->inode->data[i] + begin - p1, buf + cnt, end - begin);
+		newfs_buf *b = newfs_file_block(t->inode, i, end - begin == super.sz_block);
+		if(b == NULL) {
+			break; // out of space
+		}
+		memcpy(b->data + begin - p1, buf + cnt, end - begin);
+		newfs_bdirty(b);
+		newfs_brelse(b);
 		cnt += end - begin;
 	}
-	return size;
+	if(offset + cnt > t->inode->size) {
+		t->inode->size = offset + cnt;
+		newfs_dirty_inode(t->inode);
+	}
+	if((size_t)cnt < size) {
+		/* 写回缓存下内核页缓存里还留着没写下去的字节，由通知线程作废 */
+		newfs_notify_inval(t->inode, offset + cnt, size - cnt);
+	}
+	newfs_balance_dirty();
+	return cnt ? cnt : -ENOSPC;
 }
 
 /**
@@ -384,15 +594,16 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
  * @return int 读取大小
  */
 int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		       struct fuse_file_info* fi) {
+	NEWFS_GUARD();
 	if(size == 0) {
 		return 0;
 	}
-	newfs_dentry *t = newfs_lookup(path, super.root->dentry, false);
+	newfs_dentry *t = file_dentry(path, fi);
 	if(t == NULL) {
 		return -ENOENT;
 	}
@@ -403,13 +614,13 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		t->inode = newfs_read_inode(t->ino, t);
 		assert(t->inode);
 	}
-	NEWFS_DEBUG("file %s size %d\n", path, t->inode->size);
+	NEWFS_TRACE(TRACE_READ, offset, size, path);
+	if(offset >= t->inode->size) {
+		return 0;
+	}
 	if(offset + size > t->inode->size) {
 		size = t->inode->size - offset;
 	}
-	if(size == 0) {
-		return 0;
-	}
 
 	int cnt = 0; // bytes read
 	for(int i=0; i<MAX_IDX_NUM; ++i) {
@@ -417,21 +628,95 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		if(offset + size <= p1) {
 			break;
 		}
-		if(t->inode->data[i] == NULL) {
-			NEWFS_DEBUG("warning: read empty data block %d\n", i);
-			continue;
-		}
 		if(offset >= p2) {
 			continue;
 		}
 		int begin = offset > p1 ? offset : p1;
 		int end = offset + size < p2 ? offset + size : p2;
-		memcpy(buf + cnt, t->inode->data[i] + begin - p1, end - begin);
+		if(t->inode->direct[i] == 0) { // hole
+			memset(buf + cnt, 0, end - begin);
+		} else {
+			newfs_buf *b = newfs_bread(t->inode->direct[i]);
+			if(b == NULL) {
+				return cnt ? cnt : -EIO;
+			}
+			memcpy(buf + cnt, b->data + begin - p1, end - begin);
+			newfs_brelse(b);
+		}
 		cnt += end - begin;
 	}
 	return size;
 }
 
+/**
+ * @brief 把一个文件的脏数据和inode写回设备，并发出写屏障
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 非零时只需数据落盘，这里与0同样处理
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
+ * @return int 0成功，否则失败
+ */
+int newfs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_dentry *t = file_dentry(path, fi);
+	if(t == NULL) {
+		return -ENOENT;
+	}
+	if(t->inode == NULL) {
+		return 0; // never loaded, nothing dirty
+	}
+	// a newly created file is only reachable once every directory above it is on disk too
+	for(newfs_dentry *d = t->parent; d; d = d->parent) {
+		newfs_inode *p = d->inode;
+		if(p && (p->dirty || p->dirty_blks) && newfs_sync_file(p, false)) {
+			return -EIO;
+		}
+	}
+	return newfs_sync_file(t->inode, true) ? -EIO : 0;
+}
+
+/**
+ * @brief 每次close时调用，写回该文件但不等待设备落盘
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
+ * @return int 0成功，否则失败
+ */
+int newfs_flush(const char* path, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_dentry *t = file_dentry(path, fi);
+	if(t == NULL || t->inode == NULL) {
+		return 0;
+	}
+	return newfs_sync_file(t->inode, false) ? -EIO : 0;
+}
+
+/**
+ * @brief 文件的最后一个引用关闭，剩余的写回交给后台线程
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
+ * @return int 0成功，否则失败
+ */
+int newfs_release(const char* path, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_close_file(fi);
+	return 0;
+}
+
+/**
+ * @brief 目录的最后一个引用关闭
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 文件信息
+ * @return int 0成功，否则失败
+ */
+int newfs_releasedir(const char* path, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_close_file(fi);
+	return 0;
+}
+
 /**
  * @brief 删除文件
  * 
@@ -465,9 +750,10 @@ int newfs_rmdir(const char* path) {
  * 
  * @param from 源文件路径
  * @param to 目标文件路径
+ * @param flags RENAME_NOREPLACE等，可忽略
  * @return int 0成功，否则失败
  */
-int newfs_rename(const char* from, const char* to) {
+int newfs_rename(const char* from, const char* to, unsigned int flags) {
 	/* 选做 */
 	return 0;
 }
@@ -481,8 +767,8 @@ int newfs_rename(const char* from, const char* to) {
  * @return int 0成功，否则失败
  */
 int newfs_open(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	NEWFS_GUARD();
+	return newfs_open_dentry(newfs_lookup(path, super.root->dentry, false), fi, false);
 }
 
 /**
@@ -493,8 +779,8 @@ int newfs_open(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则失败
  */
 int newfs_opendir(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	NEWFS_GUARD();
+	return newfs_open_dentry(newfs_lookup(path, super.root->dentry, false), fi, true);
 }
 
 /**
@@ -502,10 +788,12 @@ int newfs_opendir(const char* path, struct fuse_file_info* fi) {
  * 
  * @param path 相对于挂载点的路径
  * @param offset 改变后文件大小
+ * @param fi 文件信息，open后fh指向newfs_file，为NULL时按路径查找
  * @return int 0成功，否则失败
  */
-int newfs_truncate(const char* path, off_t offset) {
-	newfs_dentry *t = newfs_lookup(path, super.root->dentry, false);
+int newfs_truncate(const char* path, off_t offset, struct fuse_file_info* fi) {
+	NEWFS_GUARD();
+	newfs_dentry *t = file_dentry(path, fi);
 	if(t == NULL) {
 		return -ENOENT;
 	}
@@ -516,18 +804,7 @@ int newfs_truncate(const char* path, off_t offset) {
 		t->inode = newfs_read_inode(t->ino, t);
 		assert(t->inode);
 	}
-
-	int cnt = (t->inode->size + super.sz_block - 1) / super.sz_block;
-	int new_cnt = (offset + super.sz_block - 1) / super.sz_block;
-	for(int i=new_cnt; i<cnt; ++i) {
-		free(t->inode->data[i]); t->inode->data[i] = NULL;
-	}
-	for(int i=cnt; i<new_cnt; ++i) {
-		t->inode->data[i] = malloc(super.sz_block);
-		assert(t->inode->data[i]);
-	}
-	t->inode->size = offset;
-	return 0;
+	return newfs_resize(t->inode, offset);
 }
 
 
@@ -550,6 +827,46 @@ int newfs_access(const char* path, int type) {
 /******************************************************************************
 * SECTION: FUSE入口
 *******************************************************************************/
+/**
+ * @brief 高层接口的挂载与服务，展开fuse_main以便在卸载前停下通知线程
+ * 
+ * @param args fuse_opt_parse剩下的参数
+ * @return int 0成功，否则失败
+ */
+static int newfs_hl_main(struct fuse_args* args) {
+	struct fuse_cmdline_opts opts;
+	struct fuse* f;
+	int err = -1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+	if (opts.show_help || opts.mountpoint == NULL) {
+		printf("usage: %s [options] <mountpoint>\n", args->argv[0]);
+		fuse_cmdline_help();
+		fuse_lib_help(args);
+		free(opts.mountpoint);
+		return opts.show_help ? 0 : 1;
+	}
+	f = fuse_new(args, &operations, sizeof(operations), NULL);
+	if (f != NULL) {
+		if (fuse_mount(f, opts.mountpoint) == 0) {
+			if (fuse_daemonize(opts.foreground) == 0
+			    && fuse_set_signal_handlers(fuse_get_session(f)) == 0) {
+				/* open设置了keep_cache，只有作废通知发得出去才正确 */
+				if (newfs_notifier_start(f) == 0) {
+					err = opts.singlethread ? fuse_loop(f) : fuse_loop_mt(f, opts.clone_fd);
+					newfs_notifier_stop();
+				}
+				fuse_remove_signal_handlers(fuse_get_session(f));
+			}
+			fuse_unmount(f);
+		}
+		fuse_destroy(f);
+	}
+	free(opts.mountpoint);
+	return err ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -559,8 +876,15 @@ int main(int argc, char **argv)
 
 	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
 		return -1;
+	/* max_read还需要作为挂载参数传入，见fuse_conn_info的说明 */
+	char max_read[32];
+	snprintf(max_read, sizeof(max_read), "-omax_read=%d", NEWFS_MAX_IO);
+	fuse_opt_add_arg(&args, max_read);
 	
-	ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	if (newfs_options.lowlevel)
+		ret = newfs_ll_main(&args);
+	else
+		ret = newfs_hl_main(&args);
 	fuse_opt_free_args(&args);
 	return ret;
 }
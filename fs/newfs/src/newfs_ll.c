@@ -0,0 +1,463 @@
+#include "newfs.h"
+#include <fuse_lowlevel.h>
+
+/*
+ * 低层FUSE前端(--lowlevel): 按inode号而不是路径操作.
+ * fuse_ino_t就是newfs_inode的地址(根目录为FUSE_ROOT_ID). 每次回复lookup/mkdir/mknod
+ * 都持有一次inode引用, 直到内核forget, 所以内核知道的inode号都不会被淘汰.
+ */
+extern struct newfs_super super;
+
+static struct fuse_session* ll_se = NULL;
+
+static newfs_inode* ll_inode(fuse_ino_t ino)
+{
+    return ino == FUSE_ROOT_ID ? super.root : (newfs_inode*)(uintptr_t)ino;
+}
+
+static fuse_ino_t ll_ino(newfs_inode *u)
+{
+    return u == super.root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)u;
+}
+
+/// reply with `t` and count one kernel lookup on its inode. The root is pinned for the whole
+/// mount and the kernel forgets it without ever looking it up, so it is never counted
+static void ll_reply_entry(fuse_req_t req, newfs_dentry *t)
+{
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+    newfs_fill_stat(t, &e.attr);
+    if(t->inode != super.root) {
+        newfs_iget(t->inode);
+    }
+    e.ino = ll_ino(t->inode);
+    e.attr_timeout = NEWFS_ATTR_TIMEOUT;
+    e.entry_timeout = NEWFS_ENTRY_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+/// invalidations wait here for the notifier thread: the kernel may hold the very pages being
+/// invalidated while it waits on a reply, so no request thread ever sends one itself
+struct ll_inval {
+    fuse_ino_t       ino;
+    char            *path;  // high-level mode: libfuse knows the file by path only
+    off_t            off;
+    off_t            len;
+    struct ll_inval *next;
+};
+
+static pthread_mutex_t  inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   inval_cond = PTHREAD_COND_INITIALIZER;
+static struct ll_inval *inval_head = NULL;
+static struct ll_inval **inval_tail = &inval_head;
+static pthread_t        notifier;
+static bool             notifier_on = false;
+static bool             notifier_stop = false;
+static struct fuse     *notifier_fuse = NULL;
+
+/// absolute path of `u` from its dentry chain, for fuse_invalidate_path. Needs newfs_lock
+static char* inval_path(newfs_inode *u)
+{
+    newfs_dentry *d;
+    size_t len = 1, n;
+    char *path, *p;
+
+    if(u->dentry->parent == NULL) {
+        return strdup("/");
+    }
+    for(d = u->dentry; d->parent; d = d->parent) {
+        len += strlen(d->name) + 1;
+    }
+    path = malloc(len);
+    if(path == NULL) {
+        return NULL;
+    }
+    p = path + len - 1;
+    *p = '\0';
+    for(d = u->dentry; d->parent; d = d->parent) {
+        n = strlen(d->name);
+        p -= n;
+        memcpy(p, d->name, n);
+        *--p = '/';
+    }
+    return path;
+}
+
+/// the kernel's cached pages of `u` in [off, off + len) no longer match newfs, len 0 means up
+/// to the end. Only queues the request, so it is safe under newfs_lock and inside any op
+void newfs_notify_inval(newfs_inode *u, off_t off, off_t len)
+{
+    struct ll_inval *e;
+    char *path;
+
+    if(!notifier_on) {
+        return;
+    }
+    e = malloc(sizeof(*e));
+    path = notifier_fuse ? inval_path(u) : NULL;
+    if(e == NULL || (notifier_fuse && path == NULL)) {
+        NEWFS_ERR("notify: no memory, kernel cache of inode %u may be stale\n", u->ino);
+        free(e);
+        free(path);
+        return;
+    }
+    e->ino = ll_ino(u);
+    e->path = path;
+    e->off = off;
+    e->len = len;
+    e->next = NULL;
+    pthread_mutex_lock(&inval_lock);
+    *inval_tail = e;
+    inval_tail = &e->next;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/// send queued invalidations until stopped and the queue is empty. An inode the kernel has
+/// already forgotten fails with ENOENT, which is fine: it has no pages left either.
+/// fuse_invalidate_path drops the whole file, libfuse has no ranged variant
+static void* notifier_main(void *arg)
+{
+    struct ll_inval *e;
+    (void)arg;
+
+    pthread_mutex_lock(&inval_lock);
+    for(;;) {
+        while(inval_head == NULL && !notifier_stop) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+        }
+        if(inval_head == NULL) {
+            break;
+        }
+        e = inval_head;
+        inval_head = e->next;
+        if(inval_head == NULL) {
+            inval_tail = &inval_head;
+        }
+        pthread_mutex_unlock(&inval_lock);
+        if(e->path) {
+            fuse_invalidate_path(notifier_fuse, e->path);
+            free(e->path);
+        } else {
+            fuse_lowlevel_notify_inval_inode(ll_se, e->ino, e->off, e->len);
+        }
+        free(e);
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+/// start the notifier before the FUSE loop. `f` is the high-level handle to invalidate paths
+/// through; NULL sends by inode number through the low-level session
+int newfs_notifier_start(struct fuse *f)
+{
+    notifier_fuse = f;
+    notifier_stop = false;
+    if(pthread_create(&notifier, NULL, notifier_main, NULL) != 0) {
+        return -1;
+    }
+    notifier_on = true;
+    return 0;
+}
+
+/// flush what is queued and join, after the FUSE loop and before unmounting: libfuse frees
+/// the path table the high-level sends go through before newfs_destroy runs. Later
+/// newfs_notify_inval calls are dropped
+void newfs_notifier_stop(void)
+{
+    if(!notifier_on) {
+        return;
+    }
+    pthread_mutex_lock(&inval_lock);
+    notifier_on = false;
+    notifier_stop = true;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+    pthread_join(notifier, NULL);
+    notifier_fuse = NULL;
+}
+
+/// stop whichever FUSE loop is running. Safe from any thread: the flusher and trace threads
+/// have no FUSE context, and in low-level mode there is no struct fuse at all
+void newfs_exit(void)
+{
+    struct fuse_context *ctx;
+
+    if(ll_se) {
+        fuse_session_exit(ll_se);
+        return;
+    }
+    ctx = fuse_get_context();
+    if(ctx && ctx->fuse) {
+        fuse_exit(ctx->fuse);
+    }
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
+    newfs_init(conn, NULL);
+}
+
+static void ll_destroy(void *userdata)
+{
+    newfs_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    NEWFS_GUARD();
+    newfs_inode *p = ll_inode(parent);
+    if(p->ftype != DIR) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    newfs_dentry *t = newfs_dir_find(p, name);
+    if(t == NULL) {
+        // inode 0 is a negative entry, the kernel caches the ENOENT too
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = NEWFS_ENTRY_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    ll_reply_entry(req, t);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    NEWFS_GUARD();
+    newfs_inode *u = ll_inode(ino);
+    while(u != super.root && nlookup--) {
+        newfs_iput(u);
+    }
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    NEWFS_GUARD();
+    struct stat st;
+    (void)fi;
+
+    memset(&st, 0, sizeof(st));
+    newfs_fill_stat(ll_inode(ino)->dentry, &st);
+    fuse_reply_attr(req, &st, NEWFS_ATTR_TIMEOUT);
+}
+
+/// only the size can change, times and modes are ignored like utimens does
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                       struct fuse_file_info *fi)
+{
+    NEWFS_GUARD();
+    newfs_inode *u = ll_inode(ino);
+    struct stat st;
+    int ret;
+    (void)fi;
+
+    if(to_set & FUSE_SET_ATTR_SIZE) {
+        if(u->ftype != REG) {
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+        if((ret = newfs_resize(u, attr->st_size)) != 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+    }
+    memset(&st, 0, sizeof(st));
+    newfs_fill_stat(u->dentry, &st);
+    fuse_reply_attr(req, &st, NEWFS_ATTR_TIMEOUT);
+}
+
+static void ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, FILE_TYPE ftype)
+{
+    NEWFS_GUARD();
+    newfs_dentry *t;
+    int ret = newfs_create(ll_inode(parent)->dentry, name, ftype, &t);
+    if(ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    ll_reply_entry(req, t);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    (void)mode;
+    ll_make(req, parent, name, DIR);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    (void)mode;
+    (void)rdev;
+    ll_make(req, parent, name, REG);
+}
+
+static void ll_open_common(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, bool dir)
+{
+    NEWFS_GUARD();
+    int ret = newfs_open_dentry(ll_inode(ino)->dentry, fi, dir);
+    if(ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_open_common(req, ino, fi, false);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_open_common(req, ino, fi, true);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    NEWFS_GUARD();
+    (void)ino;
+    newfs_close_file(fi);
+    fuse_reply_err(req, 0);
+}
+
+/// read/write go through the path ops, which use fi->fh set by open
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    char *buf = malloc(size);
+    int ret;
+    (void)ino;
+
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    ret = newfs_read(NULL, buf, size, off, fi);
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, buf, ret);
+    }
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                     struct fuse_file_info *fi)
+{
+    int ret = newfs_write(NULL, buf, size, off, fi);
+
+    if(ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    NEWFS_GUARD();
+    newfs_file *f = (newfs_file*)(uintptr_t)fi->fh;
+    char *buf = malloc(size);
+    size_t used = 0, len;
+    struct stat st;
+    (void)ino;
+
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    memset(&st, 0, sizeof(st));
+    newfs_dentry *d = newfs_dentrys(f->inode);
+    int i = 0;
+    for(; i < off && d; d = d->next, ++i) {
+        NEWFS_TRACE(TRACE_READDIR_SKIP, i, 0, d->name);
+    }
+    for(; d; d = d->next, ++i) {
+        st.st_ino = d->ino;
+        st.st_mode = d->ftype == DIR ? S_IFDIR : S_IFREG;
+        len = fuse_add_direntry(req, buf + used, size - used, d->name, &st, i + 1);
+        if(len > size - used) {
+            break; // buffer full
+        }
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -newfs_flush(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void)ino;
+    fuse_reply_err(req, -newfs_fsync(NULL, datasync, fi));
+}
+
+static struct fuse_lowlevel_ops ll_operations = {
+    .init       = ll_init,
+    .destroy    = ll_destroy,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .mkdir      = ll_mkdir,
+    .mknod      = ll_mknod,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write      = ll_write,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_release,
+};
+
+/// mount and serve with the low-level ops; `args` is what fuse_opt_parse left
+int newfs_ll_main(struct fuse_args *args)
+{
+    struct fuse_cmdline_opts opts;
+    int err = -1;
+
+    if(fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    }
+    if(opts.show_help || opts.mountpoint == NULL) {
+        printf("usage: %s --lowlevel [options] <mountpoint>\n", args->argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        return opts.show_help ? 0 : 1;
+    }
+    ll_se = fuse_session_new(args, &ll_operations, sizeof(ll_operations), NULL);
+    if(ll_se != NULL) {
+        if(fuse_set_signal_handlers(ll_se) == 0) {
+            if(fuse_session_mount(ll_se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                // open() sets keep_cache, which is only correct while invalidations get out
+                if(newfs_notifier_start(NULL) == 0) {
+                    err = opts.singlethread ? fuse_session_loop(ll_se)
+                                            : fuse_session_loop_mt(ll_se, opts.clone_fd);
+                    newfs_notifier_stop();
+                }
+                fuse_session_unmount(ll_se);
+            }
+            fuse_remove_signal_handlers(ll_se);
+        }
+        fuse_session_destroy(ll_se);
+        ll_se = NULL;
+    }
+    free(opts.mountpoint);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+#include "newfs.h"
+#include "types.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/// one ring per thread; only its owner produces and only the flusher (or a crash) consumes
+typedef struct newfs_trace_ring {
+    _Atomic uint32_t head;           // next slot the owner writes
+    _Atomic uint32_t tail;           // next slot the flusher reads
+    _Atomic uint32_t dropped;        // events lost while the ring was full
+    uint32_t         reported;       // drops already written out
+    atomic_bool      owned;          // false once the thread exits, the ring is then reused
+    uint32_t         tid;
+    struct newfs_trace_ring* next;
+    newfs_trace_rec  recs[NEWFS_TRACE_RING];
+} newfs_trace_ring;
+
+bool newfs_trace_on = false;
+
+/// "name|format" per event, written into the file header for the decoder
+static const char* trace_fmt[NEWFS_TRACE_EVENT_NUM] = {
+    [TRACE_DROPPED]      = "dropped|dropped {a} events",
+    [TRACE_LOOKUP]       = "lookup|lookup {s} from inode {a}",
+    [TRACE_ALLOC_BLOCK]  = "alloc_block|alloc block {a}",
+    [TRACE_FREE_BLOCK]   = "free_block|free block {a}",
+    [TRACE_ALLOC_INODE]  = "alloc_inode|alloc inode {a} for {s}",
+    [TRACE_SYNC_INODE]   = "sync_inode|sync inode {a}, named {s}",
+    [TRACE_READDIR_SKIP] = "readdir_skip|readdir skip {a} {s}",
+    [TRACE_MKDIR]        = "mkdir|mkdir {s} using inode {a}",
+    [TRACE_MKNOD]        = "mknod|mknod {s} using inode {a}",
+    [TRACE_READ]         = "read|read {s} at {a}, size {b}",
+    [TRACE_WRITE]        = "write|write {s} at {a}, size {b}",
+    [TRACE_EVICT]        = "evict|evict inode {a} ({s}), {b} bytes",
+};
+
+static _Atomic(newfs_trace_ring*) rings = NULL;
+static pthread_key_t              ring_key;
+static __thread newfs_trace_ring* my_ring = NULL;
+static int                        trace_fd = -1;
+static pthread_t                  flusher;
+static pthread_mutex_t            flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t             flush_cond = PTHREAD_COND_INITIALIZER;
+static bool                       flusher_stop = false;
+static _Atomic int                flush_owner = 0;   // tid of the thread writing out the rings, 0 when free
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ring_release(void* arg)
+{
+    newfs_trace_ring* r = arg;
+    atomic_store(&r->owned, false);
+}
+
+/// find this thread's ring: reuse one left by an exited thread, or push a new one
+static newfs_trace_ring* ring_get(void)
+{
+    newfs_trace_ring *r;
+    bool free_ring;
+
+    if(my_ring) {
+        return my_ring;
+    }
+    for(r = atomic_load(&rings); r; r = r->next) {
+        free_ring = false;
+        if(atomic_compare_exchange_strong(&r->owned, &free_ring, true)) {
+            break;
+        }
+    }
+    if(!r) {
+        r = calloc(1, sizeof(newfs_trace_ring));
+        if(!r) {
+            return NULL;
+        }
+        atomic_store(&r->owned, true);
+        r->next = atomic_load(&rings);
+        while(!atomic_compare_exchange_weak(&rings, &r->next, r));
+    }
+    r->tid = syscall(SYS_gettid);
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+/// record one event; never blocks, drops the event when the ring is full
+void newfs_trace_emit(int event, int64_t a, int64_t b, const char* s)
+{
+    newfs_trace_ring *r = ring_get();
+    newfs_trace_rec *rec;
+    uint32_t h;
+
+    if(!r) {
+        return;
+    }
+    h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if(h - atomic_load_explicit(&r->tail, memory_order_acquire) >= NEWFS_TRACE_RING) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    rec = &r->recs[h % NEWFS_TRACE_RING];
+    rec->ts_ns = trace_now();
+    rec->tid   = r->tid;
+    rec->event = event;
+    rec->a     = a;
+    rec->b     = b;
+    if(s) {
+        strncpy(rec->s, s, NEWFS_TRACE_STR);
+    } else {
+        rec->s[0] = '\0';
+    }
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+/// only one thread may consume the rings at a time; a lock would deadlock a crash or assert
+/// that fires inside the flusher, so claim with a CAS. A crash must not lose the rings: it
+/// resumes a flush it interrupted on its own thread, and takes over one that does not finish
+/// soon. Tails advance after every write, so at worst a run of records is written twice
+static bool flush_claim(bool crash)
+{
+    int me = syscall(SYS_gettid), owner;
+    struct timespec ts = { 0, 1000000 };
+
+    for(int i = 0; ; i++) {
+        owner = 0;
+        if(atomic_compare_exchange_strong(&flush_owner, &owner, me)) {
+            return true;
+        }
+        if(owner == me) {
+            return crash;
+        }
+        if(crash && i >= NEWFS_TRACE_CRASH_WAIT) {
+            atomic_store(&flush_owner, me);
+            return true;
+        }
+        if(!crash && i >= 1000) {
+            return false;
+        }
+        nanosleep(&ts, NULL);
+    }
+}
+
+/// write out everything recorded so far; only write(2), so it is safe in a signal handler
+static void trace_flush(bool crash)
+{
+    newfs_trace_ring *r;
+    newfs_trace_rec drop;
+    uint32_t h, t, lost, n;
+
+    if(trace_fd < 0 || !flush_claim(crash)) {
+        return;
+    }
+    for(r = atomic_load(&rings); r; r = r->next) {
+        h = atomic_load_explicit(&r->head, memory_order_acquire);
+        t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while(t != h) {
+            // contiguous run up to the end of the ring
+            n = NEWFS_TRACE_RING - t % NEWFS_TRACE_RING;
+            n = n < h - t ? n : h - t;
+            if(write(trace_fd, &r->recs[t % NEWFS_TRACE_RING], n * sizeof(newfs_trace_rec)) < 0) {
+                break;
+            }
+            t += n;
+            atomic_store_explicit(&r->tail, t, memory_order_release);
+        }
+        lost = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if(lost != r->reported) {
+            memset(&drop, 0, sizeof(drop));
+            drop.ts_ns = trace_now();
+            drop.tid   = r->tid;
+            drop.event = TRACE_DROPPED;
+            drop.a     = lost - r->reported;
+            r->reported = lost;
+            if(write(trace_fd, &drop, sizeof(drop)) < 0) {
+                break;
+            }
+        }
+    }
+    atomic_store(&flush_owner, 0);
+}
+
+void newfs_trace_flush(void)
+{
+    trace_flush(false);
+}
+
+static void* trace_flusher(void* arg)
+{
+    struct timespec ts;
+    (void)arg;
+
+    pthread_mutex_lock(&flush_lock);
+    while(!flusher_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += NEWFS_TRACE_FLUSH_MS * 1000000L;
+        ts.tv_sec  += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&flush_cond, &flush_lock, &ts);
+        newfs_trace_flush();
+    }
+    pthread_mutex_unlock(&flush_lock);
+    return NULL;
+}
+
+/// crash: save what the rings hold, then die the way we would have
+static void trace_crash(int sig)
+{
+    trace_flush(true);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/// start tracing into `path`; tracing stays off when `path` is NULL or empty
+int newfs_trace_init(const char* path)
+{
+    newfs_trace_hdr hdr;
+    char fmt[NEWFS_TRACE_FMT_LEN];
+    int sigs[] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL };
+
+    if(!path || !*path || trace_fd >= 0) {
+        return 0;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace_fd < 0) {
+        NEWFS_ERR("can't open trace %s\n", path);
+        return -errno;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic    = NEWFS_TRACE_MAGIC;
+    hdr.rec_size = sizeof(newfs_trace_rec);
+    hdr.nevents  = NEWFS_TRACE_EVENT_NUM;
+    hdr.fmt_len  = NEWFS_TRACE_FMT_LEN;
+    if(write(trace_fd, &hdr, sizeof(hdr)) < 0) {
+        goto err;
+    }
+    for(int i = 0; i < NEWFS_TRACE_EVENT_NUM; i++) {
+        memset(fmt, 0, sizeof(fmt));
+        safe_strcpy(fmt, trace_fmt[i] ? trace_fmt[i] : "?", NEWFS_TRACE_FMT_LEN);
+        if(write(trace_fd, fmt, sizeof(fmt)) < 0) {
+            goto err;
+        }
+    }
+
+    pthread_key_create(&ring_key, ring_release);
+    flusher_stop = false;
+    if(pthread_create(&flusher, NULL, trace_flusher, NULL) != 0) {
+        goto err;
+    }
+    for(size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+        signal(sigs[i], trace_crash);
+    }
+    newfs_trace_on = true;
+    return 0;
+err:
+    NEWFS_ERR("can't start trace %s\n", path);
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+}
+
+/// stop the flusher and write out the rest, called on unmount
+void newfs_trace_stop(void)
+{
+    if(trace_fd < 0) {
+        return;
+    }
+    newfs_trace_on = false;
+    pthread_mutex_lock(&flush_lock);
+    flusher_stop = true;
+    pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(flusher, NULL);
+    newfs_trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+}
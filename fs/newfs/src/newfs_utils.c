@@ -4,66 +4,553 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
 extern struct newfs_super super;
 
-/// read a logical block from the device
-int newfs_driver_read(int blkno, void* buf_)
+/// an asynchronous block write that has not been reaped yet
+typedef struct newfs_aio {
+    int   blkno;
+    void* buf;
+    bool  owned; // free `buf` once the write completes
+} newfs_aio;
+
+/// inodes with something to write back, see newfs_dirty_inode
+static newfs_inode* dirty_list = NULL;
+static long         dirty_bytes = 0;   // dirty directory blocks not yet handed to the block cache
+
+/// loaded inodes and their dentrys, bounded by icache_cap
+static newfs_inode* lru_first = NULL;  // most recently used
+static newfs_inode* lru_last = NULL;
+static size_t       icache_bytes = 0;
+static size_t       icache_cap = NEWFS_ICACHE_MEM;
+
+/// absolute path -> dentry, direct mapped; a NULL dentry caches ENOENT.
+/// Entries from an older generation are stale: eviction frees dentrys, so it bumps it
+typedef struct newfs_dcache_slot {
+    uint32_t      hash;
+    uint32_t      gen;
+    char*         path;
+    newfs_dentry* dentry;
+} newfs_dcache_slot;
+
+static newfs_dcache_slot dcache[NEWFS_DCACHE_SLOTS];
+static uint32_t          dcache_gen = 1;
+static uint64_t          dcache_hits, dcache_misses;
+
+/// one big lock for the whole file system, taken by every FUSE op and by the flusher
+static pthread_mutex_t newfs_lock;
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+
+/// the background writeback thread
+static pthread_t      flusher;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static bool           flusher_on = false;
+static bool           flusher_stop = false;
+
+static newfs_aio* aio_inflight[NEWFS_AIO_DEPTH];
+static int        aio_cnt = 0;
+
+/// freed blocks not yet discarded on the device
+static int discard_pending[NEWFS_DISCARD_BATCH];
+static int discard_cnt = 0;
+
+static bool aio_is_inflight(int blkno)
 {
-    char *buf = buf_;
-    for(int i = 0; i < super.io_per_block; i++) {
-        if(ddriver_seek(super.fd, (blkno * super.io_per_block + i) * super.sz_io, SEEK_SET) < 0 ||
-            ddriver_read(super.fd, buf + i * super.sz_io, super.sz_io) != super.sz_io) {
-            return 1;
+    for(int i = 0; i < aio_cnt; i++) {
+        if(aio_inflight[i]->blkno == blkno) {
+            return true;
         }
     }
+    return false;
+}
+
+/// reap at least `min` completed writes
+static int aio_reap(int min)
+{
+    struct ddriver_cqe cqes[NEWFS_AIO_DEPTH];
+    int err = 0;
+    int n = ddriver_poll_completions(super.fd, cqes, NEWFS_AIO_DEPTH, min);
+    for(int i = 0; i < n; i++) {
+        newfs_aio *a = cqes[i].priv;
+        if(cqes[i].res != super.sz_block) {
+            NEWFS_ERR("async write of block %d failed: %ld\n", a->blkno, cqes[i].res);
+            err = 1;
+        }
+        for(int j = 0; j < aio_cnt; j++) {
+            if(aio_inflight[j] == a) {
+                aio_inflight[j] = aio_inflight[--aio_cnt];
+                break;
+            }
+        }
+        if(a->owned) {
+            free(a->buf);
+        }
+        free(a);
+    }
+    return err;
+}
+
+/// wait for every in-flight asynchronous write
+int newfs_driver_drain(void)
+{
+    int err = 0;
+    while(aio_cnt > 0) {
+        err |= aio_reap(1);
+    }
+    return err;
+}
+
+/// the block cache: a fixed pool of buffers keyed by block number, replaced by 2Q.
+/// Blocks seen once wait in the A1in FIFO; only a block referenced again after it
+/// left A1in (still remembered in the A1out ghost list) is promoted to the Am LRU,
+/// so a single scan over a big file can't flush the hot inode and directory blocks.
+static struct {
+    int        kin;                       // A1in share of the pool
+    int        kout;                      // number of remembered block numbers
+    uint8_t*   pool;
+    newfs_buf* bufs;
+    newfs_buf* hash[NEWFS_BCACHE_BLKS];
+    newfs_buf  free, a1in, am;            // list heads, most recent at head->next
+    int        nin;
+    int        ndirty;                    // dirty buffers, counted towards NEWFS_DIRTY_MAX
+    int*       ghost;                     // A1out, a ring of evicted block numbers
+    int        ghost_head, ghost_cnt;
+    uint64_t   hits, misses, evicts, writebacks;
+} bc;
+
+static void buf_unlink(newfs_buf *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void buf_push(newfs_buf *head, newfs_buf *b)
+{
+    b->next = head->next;
+    b->prev = head;
+    head->next->prev = b;
+    head->next = b;
+}
+
+static void buf_clean(newfs_buf *b)
+{
+    if(b->dirty) {
+        b->dirty = false;
+        bc.ndirty--;
+    }
+}
+
+static newfs_buf* bcache_lookup(int blkno)
+{
+    newfs_buf *b = bc.hash[blkno % NEWFS_BCACHE_BLKS];
+    for(; b && b->blkno != blkno; b = b->hnext);
+    return b;
+}
+
+static void bcache_unhash(newfs_buf *b)
+{
+    newfs_buf **pp = &bc.hash[b->blkno % NEWFS_BCACHE_BLKS];
+    for(; *pp != b; pp = &(*pp)->hnext);
+    *pp = b->hnext;
+}
+
+/// forget `blkno` if it is in A1out; true when it was
+static bool ghost_take(int blkno)
+{
+    for(int i = 0; i < bc.ghost_cnt; i++) {
+        int k = (bc.ghost_head + i) % bc.kout;
+        if(bc.ghost[k] == blkno) {
+            bc.ghost[k] = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ghost_push(int blkno)
+{
+    if(bc.ghost_cnt == bc.kout) {
+        bc.ghost_head = (bc.ghost_head + 1) % bc.kout;
+        bc.ghost_cnt--;
+    }
+    bc.ghost[(bc.ghost_head + bc.ghost_cnt++) % bc.kout] = blkno;
+}
+
+/// read a logical block from the device, bypassing the cache
+static int dev_read(int blkno, void* buf)
+{
+    if(aio_is_inflight(blkno) && newfs_driver_drain()) {
+        return 1;
+    }
+    if(ddriver_pread(super.fd, buf, super.sz_block, (off_t)blkno * super.sz_block) != super.sz_block) {
+        return 1;
+    }
     return 0;
 }
 
-int newfs_driver_read_range(int blkno, void* dest, int begin, int end)
+/// write a logical block to the device, bypassing the cache
+static int dev_write(int blkno, void* buf)
 {
-    assert(begin >= 0 && end <= super.sz_block && begin <= end);
-    char *buf = malloc(super.sz_block);
-    assert(buf);
+    if(aio_is_inflight(blkno) && newfs_driver_drain()) {
+        return 1;
+    }
+    if(ddriver_pwrite(super.fd, buf, super.sz_block, (off_t)blkno * super.sz_block) != super.sz_block) {
+        return 1;
+    }
+    return 0;
+}
+
+/// queue a logical block write; `buf` must stay untouched until it is reaped,
+/// or is handed over to the driver when `owned`
+static int dev_write_async(int blkno, void* buf, bool owned)
+{
+    if((aio_is_inflight(blkno) || aio_cnt == NEWFS_AIO_DEPTH) && newfs_driver_drain()) {
+        return 1;
+    }
+    newfs_aio *a = malloc(sizeof(newfs_aio));
+    assert(a);
+    a->blkno = blkno; a->buf = buf; a->owned = owned;
 
-    if(newfs_driver_read(blkno, buf)) {
-        free(buf);
+    int ret = ddriver_submit_write(super.fd, buf, super.sz_block, (off_t)blkno * super.sz_block, a);
+    if(ret == -EAGAIN) {
+        newfs_driver_drain();
+        ret = ddriver_submit_write(super.fd, buf, super.sz_block, (off_t)blkno * super.sz_block, a);
+    }
+    if(ret < 0) {
+        if(owned) {
+            free(buf);
+        }
+        free(a);
         return 1;
     }
-    memcpy(dest, buf + begin, end - begin);
-    free(buf);
+    aio_inflight[aio_cnt++] = a;
     return 0;
 }
 
-/// write a logical block to the device
-int newfs_driver_write(int blkno, void* buf_)
+/// take a free buffer, or evict the unpinned one 2Q picks: the oldest of A1in
+/// while A1in is over its share, otherwise the least recently used of Am
+static newfs_buf* bcache_victim(void)
 {
-    char *buf = (char*)buf_;
-    for(int i = 0; i < super.io_per_block; i++) {
-        if(ddriver_seek(super.fd, (blkno * super.io_per_block + i) * super.sz_io, SEEK_SET) < 0 ||
-            ddriver_write(super.fd, buf + i * super.sz_io, super.sz_io) != super.sz_io) {
-            return 1;
+    newfs_buf *b;
+    if(bc.free.next != &bc.free) {
+        b = bc.free.next;
+        buf_unlink(b);
+        return b;
+    }
+
+    newfs_buf *order[2] = { &bc.a1in, &bc.am };
+    if(bc.nin <= bc.kin) {
+        order[0] = &bc.am; order[1] = &bc.a1in;
+    }
+    for(int q = 0; q < 2; q++) {
+        for(b = order[q]->prev; b != order[q]; b = b->prev) {
+            if(b->pin == 0) {
+                goto found;
+            }
+        }
+    }
+    return NULL;
+found:
+    if(b->dirty) {
+        if(dev_write(b->blkno, b->data)) {
+            return NULL;
+        }
+        buf_clean(b);
+        bc.writebacks++;
+    }
+    if(b->queue == BUF_A1IN) {
+        ghost_push(b->blkno);
+        bc.nin--;
+    }
+    buf_unlink(b);
+    bcache_unhash(b);
+    b->queue = BUF_FREE;
+    bc.evicts++;
+    return b;
+}
+
+static newfs_buf* bcache_get(int blkno, bool read)
+{
+    newfs_buf *b = bcache_lookup(blkno);
+    if(b) {
+        bc.hits++;
+        if(b->queue == BUF_AM) { // a hit in A1in is a correlated reference, it stays put
+            buf_unlink(b);
+            buf_push(&bc.am, b);
         }
+        b->pin++;
+        return b;
+    }
+
+    bc.misses++;
+    b = bcache_victim();
+    if(!b) {
+        return NULL;
+    }
+    if(read && dev_read(blkno, b->data)) {
+        buf_push(&bc.free, b);
+        return NULL;
+    }
+    b->blkno = blkno;
+    b->dirty = false;
+    b->pin = 1;
+    if(ghost_take(blkno)) {
+        b->queue = BUF_AM;
+        buf_push(&bc.am, b);
+    } else {
+        b->queue = BUF_A1IN;
+        buf_push(&bc.a1in, b);
+        bc.nin++;
+    }
+    b->hnext = bc.hash[blkno % NEWFS_BCACHE_BLKS];
+    bc.hash[blkno % NEWFS_BCACHE_BLKS] = b;
+    return b;
+}
+
+/// set up the buffer pool, `super.sz_block` must be known
+int newfs_bcache_init(void)
+{
+    memset(&bc, 0, sizeof(bc));
+    bc.kin = NEWFS_BCACHE_BLKS / 4;
+    bc.kout = NEWFS_BCACHE_BLKS / 2;
+    bc.pool = malloc((size_t)NEWFS_BCACHE_BLKS * super.sz_block);
+    bc.bufs = calloc(NEWFS_BCACHE_BLKS, sizeof(newfs_buf));
+    bc.ghost = malloc(bc.kout * sizeof(int));
+    if(!bc.pool || !bc.bufs || !bc.ghost) {
+        return 1;
+    }
+    bc.free.next = bc.free.prev = &bc.free;
+    bc.a1in.next = bc.a1in.prev = &bc.a1in;
+    bc.am.next = bc.am.prev = &bc.am;
+    for(int i = 0; i < NEWFS_BCACHE_BLKS; i++) {
+        bc.bufs[i].data = bc.pool + (size_t)i * super.sz_block;
+        bc.bufs[i].queue = BUF_FREE;
+        buf_push(&bc.free, &bc.bufs[i]);
     }
     return 0;
 }
 
-int newfs_driver_write_range(int blkno, void* src, int begin, int end)
+static int buf_cmp(const void *a, const void *b)
+{
+    return (*(newfs_buf* const*)a)->blkno - (*(newfs_buf* const*)b)->blkno;
+}
+
+/// write every dirty buffer back in block order and wait for them
+int newfs_bcache_flush(void)
+{
+    newfs_buf **dirty = malloc(NEWFS_BCACHE_BLKS * sizeof(newfs_buf*));
+    int cnt = 0, err = 0;
+    assert(dirty);
+    for(int i = 0; i < NEWFS_BCACHE_BLKS; i++) {
+        if(bc.bufs[i].queue != BUF_FREE && bc.bufs[i].dirty) {
+            dirty[cnt++] = &bc.bufs[i];
+        }
+    }
+    qsort(dirty, cnt, sizeof(newfs_buf*), buf_cmp);
+    for(int i = 0; i < cnt; i++) {
+        if(dev_write_async(dirty[i]->blkno, dirty[i]->data, false)) {
+            err = 1;
+            continue;
+        }
+        buf_clean(dirty[i]);
+        bc.writebacks++;
+    }
+    free(dirty);
+    return newfs_driver_drain() | err;
+}
+
+/// start writing block `blkno` back if it is cached and dirty; newfs_driver_drain waits for it
+int newfs_bcache_sync(int blkno)
+{
+    newfs_buf *b = bcache_lookup(blkno);
+    if(!b || !b->dirty) {
+        return 0;
+    }
+    if(dev_write_async(b->blkno, b->data, false)) {
+        return 1;
+    }
+    buf_clean(b);
+    bc.writebacks++;
+    return 0;
+}
+
+/// free the pool; dirty buffers are lost, flush first
+void newfs_bcache_release(void)
+{
+    NEWFS_INFO("bcache: %lu hits, %lu misses, %lu evictions, %lu writebacks\n",
+               bc.hits, bc.misses, bc.evicts, bc.writebacks);
+    free(bc.pool);
+    free(bc.bufs);
+    free(bc.ghost);
+    memset(&bc, 0, sizeof(bc));
+}
+
+/// pinned buffer holding block `blkno`, read from the device on a miss
+newfs_buf* newfs_bread(int blkno)
+{
+    return bcache_get(blkno, true);
+}
+
+/// pinned buffer for block `blkno` the caller is going to overwrite entirely
+newfs_buf* newfs_bget(int blkno)
+{
+    return bcache_get(blkno, false);
+}
+
+void newfs_bdirty(newfs_buf *b)
+{
+    assert(b->pin > 0);
+    if(!b->dirty) {
+        b->dirty = true;
+        bc.ndirty++;
+    }
+}
+
+void newfs_brelse(newfs_buf *b)
+{
+    assert(b->pin > 0);
+    b->pin--;
+}
+
+/// forget a freed block, its contents no longer matter
+void newfs_bdrop(int blkno)
+{
+    newfs_buf *b = bcache_lookup(blkno);
+    if(!b) {
+        return;
+    }
+    assert(b->pin == 0);
+    if(b->queue == BUF_A1IN) {
+        bc.nin--;
+    }
+    buf_unlink(b);
+    bcache_unhash(b);
+    buf_clean(b);
+    b->queue = BUF_FREE;
+    buf_push(&bc.free, b);
+}
+
+/// read a logical block through the cache
+int newfs_driver_read(int blkno, void* buf)
+{
+    newfs_buf *b = newfs_bread(blkno);
+    if(!b) {
+        return 1;
+    }
+    memcpy(buf, b->data, super.sz_block);
+    newfs_brelse(b);
+    return 0;
+}
+
+/// read `cnt` consecutive blocks starting at `blkno` with a single driver request;
+/// cached copies are at least as new as the device, so they win
+int newfs_driver_read_blocks(int blkno, int cnt, void* buf)
+{
+    ssize_t size = (ssize_t)cnt * super.sz_block;
+    if(aio_cnt > 0 && newfs_driver_drain()) {
+        return 1;
+    }
+    if(ddriver_pread(super.fd, buf, size, (off_t)blkno * super.sz_block) != size) {
+        return 1;
+    }
+    for(int i = 0; i < cnt; i++) {
+        newfs_buf *b = bcache_lookup(blkno + i);
+        if(b) {
+            memcpy((uint8_t*)buf + (size_t)i * super.sz_block, b->data, super.sz_block);
+        }
+    }
+    return 0;
+}
+int newfs_driver_read_range(int blkno, void* dest, int begin, int end)
 {
     assert(begin >= 0 && end <= super.sz_block && begin <= end);
-    char *buf = malloc(super.sz_block);
-    assert(buf);
+    newfs_buf *b = newfs_bread(blkno);
+    if(!b) {
+        return 1;
+    }
+    memcpy(dest, b->data + begin, end - begin);
+    newfs_brelse(b);
+    return 0;
+}
+
+/// write a logical block through the cache; it reaches the device when evicted or flushed
+int newfs_driver_write(int blkno, void* buf)
+{
+    newfs_buf *b = newfs_bget(blkno);
+    if(!b) {
+        return 1;
+    }
+    memcpy(b->data, buf, super.sz_block);
+    newfs_bdirty(b);
+    newfs_brelse(b);
+    return 0;
+}
+
+static int blkno_cmp(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/// discard every pending freed block, one request per run of consecutive blocks
+int newfs_driver_discard(void)
+{
+    int err = 0;
+    if(discard_cnt == 0) {
+        return 0;
+    }
+    if(newfs_driver_drain()) { // writes to a freed block may still be in flight
+        return 1;
+    }
+    qsort(discard_pending, discard_cnt, sizeof(int), blkno_cmp);
+    for(int i = 0, j; i < discard_cnt; i = j) {
+        for(j = i + 1; j < discard_cnt && discard_pending[j] == discard_pending[j - 1] + 1; j++);
+        struct ddriver_discard d = {
+            .offset = (unsigned long long)discard_pending[i] * super.sz_block,
+            .size   = (unsigned long long)(j - i) * super.sz_block,
+        };
+        if(ddriver_ioctl(super.fd, IOC_REQ_DEVICE_DISCARD, &d) != 0) {
+            NEWFS_ERR("discard of blocks [%d, %d) failed\n", discard_pending[i], discard_pending[j - 1] + 1);
+            err = 1;
+        }
+    }
+    discard_cnt = 0;
+    return err;
+}
 
-    if(newfs_driver_read(blkno, buf)) {
-        free(buf);
+/// write `cnt` consecutive blocks starting at `blkno` with a single driver request,
+/// refreshing any cached copy so it is not written back stale later
+int newfs_driver_write_blocks(int blkno, int cnt, void* buf)
+{
+    ssize_t size = (ssize_t)cnt * super.sz_block;
+    if(aio_cnt > 0 && newfs_driver_drain()) {
         return 1;
     }
-    memcpy(buf + begin, src, end - begin);
-    if(newfs_driver_write(blkno, buf)) {
-        free(buf);
+    if(ddriver_pwrite(super.fd, buf, size, (off_t)blkno * super.sz_block) != size) {
+        return 1;
+    }
+    for(int i = 0; i < cnt; i++) {
+        newfs_buf *b = bcache_lookup(blkno + i);
+        if(b) {
+            memcpy(b->data, (uint8_t*)buf + (size_t)i * super.sz_block, super.sz_block);
+            buf_clean(b);
+        }
+    }
+    return 0;
+}
+
+/// partial write: only the bytes in [begin, end) change, the rest comes from the cache
+int newfs_driver_write_range(int blkno, void* src, int begin, int end)
+{
+    assert(begin >= 0 && end <= super.sz_block && begin <= end);
+    newfs_buf *b = newfs_bread(blkno);
+    if(!b) {
         return 1;
     }
-    free(buf);
+    memcpy(b->data + begin, src, end - begin);
+    newfs_bdirty(b);
+    newfs_brelse(b);
     return 0;
 }
 
@@ -77,6 +564,53 @@ void newfs_clear_bit(uint8_t* map, int bit) {
     map[bit / 8] &= ~(1 << (bit & 0x7));
 }
 
+/// bitmap blocks changed since their last sync, as indexes from imap_off (dmap follows imap)
+static int  *map_dirty_list = NULL;
+static bool *map_dirty_flag = NULL;
+static int   map_dirty_cnt = 0;
+
+/// copy the block of `map` (on disk from block `off`) holding `bit` into the block cache,
+/// so the flusher and fsync write it like any other block; call after every set or clear
+void newfs_map_dirty(uint8_t* map, int off, int bit)
+{
+    int i = bit / (super.sz_block * 8);
+    int idx = off + i - super.imap_off;
+    if(!map_dirty_flag) {
+        map_dirty_flag = calloc(super.imap_blks + super.dmap_blks, sizeof(bool));
+        map_dirty_list = malloc((super.imap_blks + super.dmap_blks) * sizeof(int));
+        assert(map_dirty_flag && map_dirty_list);
+    }
+    newfs_buf *b = newfs_bget(off + i);
+    assert(b);
+    memcpy(b->data, map + i * super.sz_block, super.sz_block);
+    newfs_bdirty(b);
+    newfs_brelse(b);
+    if(!map_dirty_flag[idx]) {
+        map_dirty_flag[idx] = true;
+        map_dirty_list[map_dirty_cnt++] = idx;
+    }
+}
+
+/// start writing the bitmap blocks changed since the last call; newfs_driver_drain waits for them
+int newfs_sync_maps(void)
+{
+    int err = 0;
+    for(int k = 0; k < map_dirty_cnt; k++) {
+        err |= newfs_bcache_sync(super.imap_off + map_dirty_list[k]);
+        map_dirty_flag[map_dirty_list[k]] = false;
+    }
+    map_dirty_cnt = 0;
+    return err;
+}
+
+/// forget the dirty bitmap blocks at unmount, they have been written by then
+void newfs_map_release(void)
+{
+    free(map_dirty_flag); map_dirty_flag = NULL;
+    free(map_dirty_list); map_dirty_list = NULL;
+    map_dirty_cnt = 0;
+}
+
 void newfs_extract_stem(const char *path, char *stem)
 {
     const char *p = path + strlen(path) - 1;
@@ -93,14 +627,18 @@ newfs_inode* newfs_alloc_inode(newfs_dentry *den)
     assert(super.is_mounted);
     for(int i = 0; i < super.ino_num; i++) {
         if(!newfs_test_bit(super.imap, i)) {
-            NEWFS_DEBUG("alloc inode %d for %s\n", i, den->name);
+            NEWFS_TRACE(TRACE_ALLOC_INODE, i, 0, den->name);
             newfs_set_bit(super.imap, i);
+            newfs_map_dirty(super.imap, super.imap_off, i);
             newfs_inode *inode = malloc(sizeof(newfs_inode));
             assert(inode);
             memset(inode, 0, sizeof(newfs_inode));
             inode->ino = i;
+            inode->dentrys_loaded = true; // nothing on disk yet
             inode->dentry = den;
             den->inode = inode;
+            icache_bytes += sizeof(newfs_inode);
+            newfs_touch_inode(inode);
             return inode;
         }
     }
@@ -110,52 +648,125 @@ newfs_inode* newfs_alloc_inode(newfs_dentry *den)
 static int load_dentrys(newfs_inode *inode)
 {
     assert(inode);
-    assert(inode->dentrys == NULL);
+    assert(inode->dentrys == NULL && !inode->dentrys_loaded);
     assert(inode->ftype == DIR);
     
-    int cnt = inode->size / sizeof(newfs_dentry);
+    int cnt = inode->size / sizeof(newfs_dentry_d);
     for(int i=0; i<MAX_IDX_NUM; ++i) {
         if(inode->direct[i] == 0) {
             break;
         }
-        inode->data[i] = malloc(super.sz_block);
-        assert(newfs_driver_read(inode->direct[i], inode->data[i]) == 0);
+        newfs_buf *b = newfs_bread(inode->direct[i]);
+        assert(b);
 
-        newfs_dentry_d *dens = (newfs_dentry_d*)inode->data[i];
+        newfs_dentry_d *dens = (newfs_dentry_d*)b->data;
         for(int j=0; (i * super.den_per_block) + j < cnt && j < super.den_per_block; ++j) {
             assert(dens[j].ino > 0);
             newfs_dentry *den = malloc(sizeof(newfs_dentry));
             assert(den);
+            icache_bytes += sizeof(newfs_dentry);
             
             den->ino = dens[j].ino;
             safe_strcpy(den->name, dens[j].name, MAX_NAME_LEN);
             den->ftype = dens[j].ftype;
-            den->parent = inode->dentry;
             den->inode = NULL;
-            
-            // insert to list
-            den->next = inode->dentrys;
-            inode->dentrys = den;
+            newfs_dir_add(inode, den);
         }
 
-        free(inode->data[i]); inode->data[i] = NULL;
+        newfs_brelse(b);
     }
+    inode->dentrys_loaded = true;
     return 0;
 }
 
-static int load_data(newfs_inode *inode)
+/// FNV-1a
+static uint32_t name_hash(const char *name)
 {
-    assert(inode);
-    assert(inode->data[0] == NULL);
-    assert(inode->ftype == REG);
+    uint32_t h = 2166136261u;
+    for(; *name; ++name) {
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    }
+    return h;
+}
 
-    int cnt = (inode->size + super.sz_block - 1) / super.sz_block;
-    for(int i=0; i<cnt; ++i) {
-        assert(inode->direct[i] > 0);
-        inode->data[i] = malloc(super.sz_block);
-        assert(newfs_driver_read(inode->direct[i], inode->data[i]) == 0);
+/// double the index of `dir` so chains stay short
+static void dir_index_grow(newfs_inode *dir)
+{
+    uint32_t hsize = dir->hsize ? dir->hsize * 2 : 8;
+    newfs_dentry **htab = calloc(hsize, sizeof(newfs_dentry*));
+    assert(htab);
+    for(uint32_t i = 0; i < dir->hsize; i++) {
+        for(newfs_dentry *d = dir->htab[i], *nxt; d; d = nxt) {
+            nxt = d->hnext;
+            d->hnext = htab[d->hash & (hsize - 1)];
+            htab[d->hash & (hsize - 1)] = d;
+        }
     }
-    return 0;
+    icache_bytes += (hsize - dir->hsize) * sizeof(newfs_dentry*);
+    free(dir->htab);
+    dir->htab = htab;
+    dir->hsize = hsize;
+}
+
+/// link `den` into directory `dir`: at the head of its list, and into its name index
+void newfs_dir_add(newfs_inode *dir, newfs_dentry *den)
+{
+    if(dir->hcount >= dir->hsize) {
+        dir_index_grow(dir);
+    }
+    den->hash = name_hash(den->name);
+    den->hnext = dir->htab[den->hash & (dir->hsize - 1)];
+    dir->htab[den->hash & (dir->hsize - 1)] = den;
+    dir->hcount++;
+
+    den->parent = dir->dentry;
+    den->next = dir->dentrys;
+    dir->dentrys = den;
+}
+
+/// entry `name` of directory `dir`, or NULL
+newfs_dentry* newfs_dir_find(newfs_inode *dir, const char *name)
+{
+    newfs_dentrys(dir);
+    if(dir->hcount == 0) {
+        return NULL;
+    }
+    uint32_t h = name_hash(name);
+    for(newfs_dentry *d = dir->htab[h & (dir->hsize - 1)]; d; d = d->hnext) {
+        if(d->hash == h && strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/// entries of directory `inode`, read from its blocks the first time they are needed
+newfs_dentry* newfs_dentrys(newfs_inode *inode)
+{
+    if(!inode->dentrys_loaded) {
+        assert(load_dentrys(inode) == 0);
+    }
+    return inode->dentrys;
+}
+
+/// pinned buffer for block `i` of regular file `u`: read in on first touch, or allocated
+/// and zeroed when it is a hole; `whole` skips the read when the caller overwrites it all
+newfs_buf* newfs_file_block(newfs_inode *u, int i, bool whole)
+{
+    assert(u->ftype == REG && i >= 0 && i < MAX_IDX_NUM);
+    if(u->direct[i] == 0) {
+        u->direct[i] = newfs_alloc_block();
+        if(u->direct[i] == 0) {
+            return NULL;
+        }
+        newfs_dirty_inode(u);
+        newfs_buf *b = newfs_bget(u->direct[i]);
+        if(b) {
+            memset(b->data, 0, super.sz_block);
+        }
+        return b;
+    }
+    return whole ? newfs_bget(u->direct[i]) : newfs_bread(u->direct[i]);
 }
 
 newfs_inode* newfs_read_inode(int ino, newfs_dentry *den)
@@ -163,7 +774,7 @@ newfs_inode* newfs_read_inode(int ino, newfs_dentry *den)
     int blkno = super.ino_off + ino / super.ino_per_block;
     int offset = (ino % super.ino_per_block) * sizeof(newfs_inode_d);
     
-    newfs_inode *inode = malloc(sizeof(newfs_inode));
+    newfs_inode *inode = calloc(1, sizeof(newfs_inode));
     assert(inode);
     newfs_inode_d inode_d;
     if(newfs_driver_read_range(blkno, &inode_d, offset, offset + sizeof(newfs_inode_d))) {
@@ -178,73 +789,129 @@ newfs_inode* newfs_read_inode(int ino, newfs_dentry *den)
     memcpy(inode->direct, inode_d.direct, sizeof(inode->direct));
     inode->dentry = den;
     den->inode = inode;
+    icache_bytes += sizeof(newfs_inode);
+    newfs_touch_inode(inode);
+    // metadata only: dentrys and file blocks are read when first used
+    return inode;
+}
 
-    if(inode->ftype == DIR) {
-        load_dentrys(inode);
-    } else {
-        load_data(inode);
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// queue `u` for the next newfs_sync_dirty
+static void dirty_enqueue(newfs_inode *u)
+{
+    if(!u->dirty && !u->dirty_blks) {
+        u->dirty_next = dirty_list;
+        u->dirty_since = now_ms();
+        dirty_list = u;
     }
-    return inode;
 }
 
-int newfs_sync_inode(newfs_inode *u)
+/// take `u` off the dirty list
+static void dirty_dequeue(newfs_inode *u)
 {
-    NEWFS_DEBUG("sync inode %d, named %s\n", u->ino, u->dentry->name);
-    if(u->ftype == DIR) {
-        // write sub-nodes to disk
-        newfs_dentry *v = u->dentrys;
-        for(; v; v = v->next) {
-            if(v->inode) {
-                assert(newfs_sync_inode(v->inode) == 0);
-            }
-        }
+    newfs_inode **pp = &dirty_list;
+    for(; *pp && *pp != u; pp = &(*pp)->dirty_next);
+    if(*pp) {
+        *pp = u->dirty_next;
+    }
+    u->dirty_next = NULL;
+}
 
-        // write dentrys to disk
-        int capacity = 0;
-        for(;capacity < MAX_IDX_NUM && u->data[capacity]; ++capacity);
-        int need = (u->size + sizeof(newfs_dentry_d) - 1) / sizeof(newfs_dentry_d);
-        need = (need + super.den_per_block - 1) / super.den_per_block;
+/// the inode's size or index changed
+void newfs_dirty_inode(newfs_inode *u)
+{
+    dirty_enqueue(u);
+    u->dirty = true;
+}
 
-        for(; capacity < need; ++capacity) {
-            u->direct[capacity] = newfs_alloc_block();
-            assert(u->direct[capacity] > 0);
-        }
-        for(; capacity > need; --capacity) {
-            newfs_free_block(u->direct[capacity - 1]);
-            u->direct[capacity - 1] = 0;
-        }
+/// block `i` of the inode (data, or dentrys of a directory) changed
+void newfs_dirty_block(newfs_inode *u, int i)
+{
+    assert(i >= 0 && i < MAX_IDX_NUM);
+    dirty_enqueue(u);
+    if(!(u->dirty_blks & 1 << i)) {
+        dirty_bytes += super.sz_block;
+    }
+    u->dirty_blks |= 1 << i;
+}
 
-        newfs_dentry_d *buf = malloc(super.sz_block);
-        assert(buf);
-        v = u->dentrys;
-        for(int i=0; i<capacity; ++i) {
-            memset(buf, 0, super.sz_block);
-            for(int j=0; j<super.den_per_block && v; ++j, v = v->next) {
-                buf[j].ino = v->ino;
-                safe_strcpy(buf[j].name, v->name, MAX_NAME_LEN);
-                buf[j].ftype = v->ftype;
-            }
-            assert(newfs_driver_write(u->direct[i], buf) == 0);
-        }
-        free(buf);
-    } else {
-        int capacity = 0;
-        for(;capacity < MAX_IDX_NUM && u->direct[capacity]; ++capacity);
-        int need = (u->size + super.sz_block - 1) / super.sz_block;
+/// grow or shrink the block index to `need` blocks; true when it changed
+static bool resize_blocks(newfs_inode *u, int need)
+{
+    int capacity = 0;
+    bool changed = false;
+    for(; capacity < MAX_IDX_NUM && u->direct[capacity]; ++capacity);
 
-        for(; capacity < need; ++capacity) {
-            u->direct[capacity] = newfs_alloc_block();
-            assert(u->direct[capacity] > 0);
-        }
-        for(; capacity > need; --capacity) {
-            newfs_free_block(u->direct[capacity - 1]);
-            u->direct[capacity - 1] = 0;
-        }
+    for(; capacity < need; ++capacity) {
+        u->direct[capacity] = newfs_alloc_block();
+        assert(u->direct[capacity] > 0);
+        u->dirty_blks |= 1 << capacity; // nothing on disk yet
+        changed = true;
+    }
+    for(; capacity > need; --capacity) {
+        newfs_free_block(u->direct[capacity - 1]);
+        u->direct[capacity - 1] = 0;
+        changed = true;
+    }
+    u->dirty_blks &= (1 << need) - 1;
+    return changed;
+}
+
+/// write back what changed in `u` alone: its dirty blocks and, if needed, its on-disk inode
+int newfs_sync_inode(newfs_inode *u)
+{
+    NEWFS_TRACE(TRACE_SYNC_INODE, u->ino, 0, u->dentry->name);
+    bool meta = u->dirty;
+    dirty_bytes -= (long)__builtin_popcount(u->dirty_blks) * super.sz_block;
+    if(u->ftype == DIR) {
+        int cnt = u->size / sizeof(newfs_dentry_d);
+        int need = (cnt + super.den_per_block - 1) / super.den_per_block;
+        meta |= resize_blocks(u, need);
+
+        if(u->dirty_blks) {
+            // entries are kept newest first in memory and oldest first on disk,
+            // so a new entry only changes the last block
+            newfs_dentry **order = malloc(sizeof(newfs_dentry*) * (cnt ? cnt : 1));
+            assert(order);
+            int k = cnt;
+            for(newfs_dentry *v = u->dentrys; v; v = v->next) {
+                assert(k > 0);
+                order[--k] = v;
+            }
+            assert(k == 0);
 
-        for(int i=0; i<capacity; ++i) {
-            assert(newfs_driver_write(u->direct[i], u->data[i]) == 0);
+            for(int i=0; i<need; ++i) {
+                if(!(u->dirty_blks & 1 << i)) {
+                    continue;
+                }
+                newfs_buf *b = newfs_bget(u->direct[i]);
+                assert(b);
+                newfs_dentry_d *buf = (newfs_dentry_d*)b->data;
+                memset(buf, 0, super.sz_block);
+                for(int j=0; j<super.den_per_block && i * super.den_per_block + j < cnt; ++j) {
+                    newfs_dentry *v = order[i * super.den_per_block + j];
+                    buf[j].ino = v->ino;
+                    safe_strcpy(buf[j].name, v->name, MAX_NAME_LEN);
+                    buf[j].ftype = v->ftype;
+                }
+                newfs_bdirty(b);
+                newfs_brelse(b);
+            }
+            free(order);
         }
     }
+    // file data is written into the block cache directly, only the inode is left
+    u->dirty = false;
+    u->dirty_blks = 0;
+    if(!meta) {
+        return 0;
+    }
 
     newfs_inode_d d;
     d.ino = u->ino; d.size = u->size; d.link = u->link; d.ftype = u->ftype;
@@ -258,51 +925,297 @@ int newfs_sync_inode(newfs_inode *u)
     return 0;
 }
 
-int newfs_unmap_inode(newfs_inode *u)
+/// write back every inode on the dirty list; clean inodes and blocks are never touched
+int newfs_sync_dirty(void)
 {
-    if(u->ftype == REG) {
-        for(int i=0; i<MAX_IDX_NUM && u->data[i]; ++i) {
-            if(u->data[i]) {
-                free(u->data[i]);
-                u->data[i] = NULL;
-            }
+    while(dirty_list) {
+        newfs_inode *u = dirty_list;
+        dirty_list = u->dirty_next;
+        u->dirty_next = NULL;
+        if(newfs_sync_inode(u)) {
+            return 1;
         }
-        free(u);
-        return 0;
     }
+    return 0;
+}
 
-    // unmap sub-nodes & sub-dentrys
-    newfs_dentry *v = u->dentrys;
-    for(; v;) {
-        if(v->inode) {
-            assert(newfs_unmap_inode(v->inode) == 0); v->inode = NULL;
+/// push one file or directory to the device: its blocks, its inode-table slot and the
+/// changed bitmap blocks, followed by a device flush when `barrier` (fsync)
+int newfs_sync_file(newfs_inode *u, bool barrier)
+{
+    int err = 0;
+    if(u->dirty || u->dirty_blks) {
+        dirty_dequeue(u);
+        err |= newfs_sync_inode(u);
+    }
+    for(int i=0; i<MAX_IDX_NUM; ++i) {
+        if(u->direct[i]) {
+            err |= newfs_bcache_sync(u->direct[i]);
         }
+    }
+    err |= newfs_bcache_sync(super.ino_off + u->ino / super.ino_per_block);
+    err |= newfs_sync_maps(); // otherwise its inode and blocks are still free on disk
+    err |= newfs_driver_drain();
+    if(barrier && ddriver_ioctl(super.fd, IOC_REQ_DEVICE_FLUSH, NULL) != 0) {
+        err = 1;
+    }
+    return err;
+}
+
+/// sync inodes dirty for longer than NEWFS_DIRTY_EXPIRE_MS, or all of them when `all`,
+/// then write the block cache back
+static int writeback(bool all)
+{
+    uint64_t now = now_ms();
+    int err = 0;
+    for(newfs_inode **pp = &dirty_list; *pp;) {
+        newfs_inode *u = *pp;
+        if(!all && now - u->dirty_since < NEWFS_DIRTY_EXPIRE_MS) {
+            pp = &u->dirty_next;
+            continue;
+        }
+        *pp = u->dirty_next;
+        u->dirty_next = NULL;
+        err |= newfs_sync_inode(u);
+    }
+    err |= newfs_sync_maps();
+    return newfs_bcache_flush() | err;
+}
+
+/// called by writers once they are done: past NEWFS_DIRTY_MAX wake the flusher,
+/// past twice that the writer pays for the writeback itself
+void newfs_balance_dirty(void)
+{
+    long dirty = dirty_bytes + (long)bc.ndirty * super.sz_block;
+    if(dirty >= 2 * NEWFS_DIRTY_MAX || (!flusher_on && dirty >= NEWFS_DIRTY_MAX)) {
+        assert(writeback(true) == 0);
+    } else if(dirty >= NEWFS_DIRTY_MAX) {
+        pthread_cond_signal(&flusher_cond);
+    }
+}
+
+static void* flusher_main(void *arg)
+{
+    struct timespec ts;
+    (void)arg;
+
+    pthread_mutex_lock(&newfs_lock);
+    while(!flusher_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += NEWFS_FLUSH_INTERVAL_MS / 1000;
+        ts.tv_nsec += (NEWFS_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+        ts.tv_sec  += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&flusher_cond, &newfs_lock, &ts);
+        if(!flusher_stop && writeback(dirty_bytes + (long)bc.ndirty * super.sz_block >= NEWFS_DIRTY_MAX)) {
+            NEWFS_ERR("background writeback failed\n");
+        }
+        newfs_shrink_icache(); // written back inodes are clean now
+    }
+    pthread_mutex_unlock(&newfs_lock);
+    return NULL;
+}
+
+int newfs_flusher_start(void)
+{
+    flusher_stop = false;
+    if(pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        return 1;
+    }
+    flusher_on = true;
+    return 0;
+}
+
+/// stop the flusher, must be called without holding newfs_lock
+void newfs_flusher_stop(void)
+{
+    if(!flusher_on) {
+        return;
+    }
+    pthread_mutex_lock(&newfs_lock);
+    flusher_stop = true;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&newfs_lock);
+    pthread_join(flusher, NULL);
+    flusher_on = false;
+}
+
+static void lock_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    // no op calls another op, so taking the lock twice is a lock-order bug: fail instead of nesting
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&newfs_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+pthread_mutex_t* newfs_lock_guard(void)
+{
+    pthread_once(&lock_once, lock_init);
+    assert(pthread_mutex_lock(&newfs_lock) == 0);
+    return &newfs_lock;
+}
+
+/// leaving an op is the one point where no dentry is held, so shrink there
+void newfs_unlock_guard(pthread_mutex_t **m)
+{
+    if(super.is_mounted) {
+        newfs_shrink_icache();
+    }
+    pthread_mutex_unlock(*m);
+}
+
+static void lru_unlink(newfs_inode *u)
+{
+    if(u->lru_prev) {
+        u->lru_prev->lru_next = u->lru_next;
+    } else if(lru_first == u) {
+        lru_first = u->lru_next;
+    }
+    if(u->lru_next) {
+        u->lru_next->lru_prev = u->lru_prev;
+    } else if(lru_last == u) {
+        lru_last = u->lru_prev;
+    }
+    u->lru_prev = u->lru_next = NULL;
+}
+
+/// free `u` and, for a directory, its dentrys; the caller clears the pointer to it
+static size_t free_inode(newfs_inode *u)
+{
+    size_t freed = sizeof(newfs_inode) + u->hsize * sizeof(newfs_dentry*);
+    for(newfs_dentry *v = u->dentrys; v;) {
         newfs_dentry* nxt = v->next;
         free(v); v = nxt;
+        freed += sizeof(newfs_dentry);
     }
-
+    free(u->htab);
+    lru_unlink(u);
     free(u);
+    icache_bytes -= freed;
+    return freed;
+}
+
+int newfs_unmap_inode(newfs_inode *u)
+{
+    // unmap sub-nodes first, free_inode takes the dentrys
+    for(newfs_dentry *v = u->dentrys; v; v = v->next) {
+        if(v->inode) {
+            assert(newfs_unmap_inode(v->inode) == 0); v->inode = NULL;
+        }
+    }
+    free_inode(u);
     return 0;
 }
 
+/// cap the memory held by loaded inodes and dentrys, 0 for no limit
+void newfs_icache_init(size_t cap)
+{
+    icache_cap = cap;
+}
+
+/// keep `u` loaded while the caller holds it
+void newfs_iget(newfs_inode *u)
+{
+    u->ref++;
+}
+
+void newfs_iput(newfs_inode *u)
+{
+    assert(u->ref > 0);
+    u->ref--;
+}
+
+/// move `u` to the head of the LRU
+void newfs_touch_inode(newfs_inode *u)
+{
+    if(u == super.root || lru_first == u) {
+        return; // the root is never evicted, so it stays off the list
+    }
+    lru_unlink(u);
+    u->lru_next = lru_first;
+    if(lru_first) {
+        lru_first->lru_prev = u;
+    }
+    lru_first = u;
+    if(!lru_last) {
+        lru_last = u;
+    }
+}
+
+/// clean, unreferenced, and for a directory none of its entries loaded,
+/// so the whole subtree below it is already gone
+static bool evictable(newfs_inode *u)
+{
+    if(u->ref || u->dirty || u->dirty_blks || u == super.root) {
+        return false;
+    }
+    for(newfs_dentry *v = u->dentrys; v; v = v->next) {
+        if(v->inode) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// evict least recently used inodes until the cache fits under its cap; a directory
+/// becomes a candidate once its children are gone, so keep going while progress is made
+void newfs_shrink_icache(void)
+{
+    bool progress = true;
+    while(icache_cap && icache_bytes > icache_cap && progress) {
+        progress = false;
+        for(newfs_inode *u = lru_last; u && icache_bytes > icache_cap;) {
+            newfs_inode *prev = u->lru_prev;
+            if(evictable(u)) {
+                newfs_dentry *den = u->dentry;
+                int ino = u->ino;
+                size_t freed = free_inode(u);
+                den->inode = NULL; // reloaded by the next lookup or op that needs it
+                dcache_gen++;
+                NEWFS_TRACE(TRACE_EVICT, ino, freed, den->name);
+                progress = true;
+            }
+            u = prev;
+        }
+    }
+}
+
 int newfs_alloc_block(void)
 {
     assert(super.is_mounted);
     for(int i = 0; i < super.data_blks; i++) {
         if(!newfs_test_bit(super.dmap, i)) {
-            NEWFS_DEBUG("alloc block %d\n", i);
+            NEWFS_TRACE(TRACE_ALLOC_BLOCK, i, 0, NULL);
             newfs_set_bit(super.dmap, i);
+            newfs_map_dirty(super.dmap, super.dmap_off, i);
+            // a reused block must not be discarded after new data lands in it
+            for(int j = 0; j < discard_cnt; j++) {
+                if(discard_pending[j] == super.data_off + i) {
+                    discard_pending[j] = discard_pending[--discard_cnt];
+                    break;
+                }
+            }
             return super.data_off + i;
         }
     }
     return 0;
 }
 
+/// free an absolute block number; the device is told in batches by newfs_driver_discard
 int newfs_free_block(int blkno)
 {
     assert(super.is_mounted);
-    assert(blkno >= 0 && blkno < super.data_blks);
-    newfs_clear_bit(super.dmap, blkno);
+    assert(blkno >= super.data_off && blkno < super.data_off + super.data_blks);
+    NEWFS_TRACE(TRACE_FREE_BLOCK, blkno, 0, NULL);
+    newfs_clear_bit(super.dmap, blkno - super.data_off);
+    newfs_map_dirty(super.dmap, super.dmap_off, blkno - super.data_off);
+    newfs_bdrop(blkno);
+    if(discard_cnt == NEWFS_DISCARD_BATCH && newfs_driver_discard()) {
+        return 1;
+    }
+    discard_pending[discard_cnt++] = blkno;
     return 0;
 }
 
@@ -311,17 +1224,72 @@ newfs_dentry* newfs_make_dentry(const char* name, FILE_TYPE ftype)
     newfs_dentry *den = malloc(sizeof(newfs_dentry));
     assert(den);
     memset(den, 0x00, sizeof(newfs_dentry));
+    icache_bytes += sizeof(newfs_dentry);
     safe_strcpy(den->name, name, MAX_NAME_LEN);
     den->ftype = ftype;
     den->next = den->parent = NULL;
     return den;
 }
 
+static newfs_dentry* lookup_from(const char *path, newfs_dentry *from, bool remain_leaf);
+
+/// resolve `path` starting at `from`, or at the root when it is absolute; with `remain_leaf`
+/// the parent of the last component is returned. Absolute full lookups go through the path cache
 newfs_dentry* newfs_lookup(const char *path, newfs_dentry *from, bool remain_leaf)
 {
-    NEWFS_DEBUG("lookup %s from %s\n", path, from->name);
+    if(path[0] != '/' || remain_leaf) {
+        return lookup_from(path, from, remain_leaf);
+    }
+    uint32_t h = name_hash(path);
+    newfs_dcache_slot *slot = &dcache[h & (NEWFS_DCACHE_SLOTS - 1)];
+    if(slot->path && slot->gen == dcache_gen && slot->hash == h && strcmp(slot->path, path) == 0) {
+        dcache_hits++;
+        if(slot->dentry && slot->dentry->inode) {
+            newfs_touch_inode(slot->dentry->inode);
+        }
+        return slot->dentry;
+    }
+    dcache_misses++;
+    newfs_dentry *den = lookup_from(path, from, false);
+    free(slot->path);
+    slot->path = strdup(path);
+    slot->hash = h;
+    slot->gen = dcache_gen;
+    slot->dentry = den;
+    return den;
+}
+
+/// `path` now exists (or is gone): drop what the cache says about it
+void newfs_dcache_forget(const char *path)
+{
+    uint32_t h = name_hash(path);
+    newfs_dcache_slot *slot = &dcache[h & (NEWFS_DCACHE_SLOTS - 1)];
+    if(slot->path && slot->hash == h && strcmp(slot->path, path) == 0) {
+        free(slot->path);
+        slot->path = NULL;
+    }
+}
+
+/// forget everything, the dentrys are being freed at unmount
+void newfs_dcache_release(void)
+{
+    NEWFS_INFO("dcache: %lu hits, %lu misses\n", dcache_hits, dcache_misses);
+    for(int i = 0; i < NEWFS_DCACHE_SLOTS; i++) {
+        free(dcache[i].path);
+        dcache[i].path = NULL;
+    }
+    dcache_gen++;
+    dcache_hits = dcache_misses = 0;
+}
+
+static newfs_dentry* lookup_from(const char *path, newfs_dentry *from, bool remain_leaf)
+{
+    NEWFS_TRACE(TRACE_LOOKUP, from->ino, 0, path);
+    if(from->inode) {
+        newfs_touch_inode(from->inode);
+    }
     if(path[0] == '/') {
-        return newfs_lookup(path + 1, super.root->dentry, remain_leaf);
+        return lookup_from(path + 1, super.root->dentry, remain_leaf);
     }
     if(strcmp(path, "") == 0) {
         assert(!remain_leaf);
@@ -340,10 +1308,13 @@ newfs_dentry* newfs_lookup(const char *path, newfs_dentry *from, bool remain_lea
         }
     }
 
-    for(newfs_dentry *den = from->inode->dentrys; den; den = den->next) {
-        if(strcmp(den->name, buffer) == 0) {
-            return newfs_lookup(p, den, remain_leaf);
-        }
+    if(from->ftype != DIR) {
+        return NULL;
     }
-    return NULL;
+    if(from->inode == NULL) { // intermediate directories may not be loaded yet
+        from->inode = newfs_read_inode(from->ino, from);
+        assert(from->inode);
+    }
+    newfs_dentry *den = newfs_dir_find(from->inode, buffer);
+    return den ? lookup_from(p, den, remain_leaf) : NULL;
 }
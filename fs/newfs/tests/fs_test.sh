@@ -108,12 +108,12 @@ function test_remount() {
     TEST_CASE=$1
     echo ">>>>>>>>>>>>>>>>>>>> TEST_REMOUNT"
     
-    fusermount -u ${MNTPOINT}
+    fusermount3 -u ${MNTPOINT}
     if [ $? -ne 0 ]; then
         fail "umount"
         exit 1
     fi
-    pass "-> fusermount -u ${MNTPOINT}"
+    pass "-> fusermount3 -u ${MNTPOINT}"
 
     ../build/${PROJECT_NAME} --device="$HOME"/ddriver ${MNTPOINT}
     if [ $? -ne 0 ]; then
@@ -130,12 +130,12 @@ function test_remount() {
 
     sleep 1
     
-    fusermount -u ${MNTPOINT}
+    fusermount3 -u ${MNTPOINT}
     if [ $? -ne 0 ]; then
         fail "umount finally"
         exit 1
     fi
-    pass "-> fusermount -u ${MNTPOINT}"
+    pass "-> fusermount3 -u ${MNTPOINT}"
 
     pass $TEST_CASE
 
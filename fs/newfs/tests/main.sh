@@ -2,9 +2,9 @@
 POINTS=0
 TOTAL_POINTS=0
 TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh)
-# mount.sh mkdir.sh touch.sh ls.sh remount.sh (read.sh write.sh cp.sh)
-ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
-ALL_TEST_SCORES=(1 4 5 4 16 2 2)
+# mount.sh mkdir.sh touch.sh ls.sh remount.sh (read.sh write.sh cp.sh) (dcache.sh discard.sh flush.sh stripe.sh sched.sh)
+ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh dcache.sh discard.sh flush.sh stripe.sh sched.sh)
+ALL_TEST_SCORES=(1 4 5 4 16 2 2 3 2 2 3 2)
 MNTPOINT='./mnt'
 PROJECT_NAME="newfs"
 
@@ -35,6 +35,10 @@ elif [[ "${LEVEL}" == "6" ]]; then
     echo "开始mount, mkdir, touch, ls, read&write, cp, umount测试"
     TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
     sleep 1
+elif [[ "${LEVEL}" == "7" ]]; then
+    echo "开始mount, mkdir, touch, ls, read&write, cp, umount, 目录缓存及ddriver特性测试"
+    TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh dcache.sh discard.sh flush.sh stripe.sh sched.sh)
+    sleep 1
 else
     echo "未知测试参数"
     exit 1
@@ -128,6 +132,19 @@ function clean_mount() {
     done
 }
 
+# umount返回时文件系统进程可能仍在写回, 等它退出后再检查ddriver介质
+function umount_and_wait() {
+    umount "${MNTPOINT}"
+    while pgrep -f -- "--device=$HOME/ddriver" > /dev/null; do
+        sleep 0.1
+    done
+}
+
+# 输出ddriver -s中以$1开头的那一行, 介质须已由上一次打开者关闭
+function ddriver_stat_line() {
+    ddriver -s 2>/dev/null | grep "^$1"
+}
+
 function mkdir_and_check () {
     DIR=$1
     if [ ! -d "$DIR" ]; then
@@ -0,0 +1,63 @@
+#!/bin/bash
+
+TEST_CASE="case 8 - dentry cache"
+
+function check_negative_touch () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    if stat "$_PARAM" > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 文件$_PARAM尚未创建, stat却返回0"
+        return 1
+    fi
+    touch "$_PARAM"
+    if ! stat "$_PARAM" > /dev/null; then
+        fail "$_TEST_CASE: stat失败后touch文件$_PARAM, 再次stat返回值非0, 请检查创建时是否清除了目录缓存中的不存在项"
+        return 1
+    fi
+    if ! ls "$(dirname "$_PARAM")" | grep -x "$(basename "$_PARAM")" > /dev/null; then
+        fail "$_TEST_CASE: ls $(dirname "$_PARAM")未列出$(basename "$_PARAM")"
+        return 1
+    fi
+    return 0
+}
+
+function check_negative_mkdir () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    if stat "$_PARAM"/file > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 目录$_PARAM尚未创建, stat $_PARAM/file却返回0"
+        return 1
+    fi
+    mkdir "$_PARAM"
+    touch "$_PARAM"/file
+    if ! stat "$_PARAM"/file > /dev/null; then
+        fail "$_TEST_CASE: stat失败后创建$_PARAM/file, 再次stat返回值非0, 请检查mkdir时是否清除了目录缓存中的不存在项"
+        return 1
+    fi
+    return 0
+}
+
+function check_remount () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    umount_and_wait
+    try_mount_or_fail
+    for f in ghost ndir/file; do
+        if ! stat "${MNTPOINT}"/$f > /dev/null; then
+            fail "$_TEST_CASE: 重新挂载后stat ${MNTPOINT}/$f返回值非0"
+            return 1
+        fi
+    done
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 8.1 - stat then touch ${MNTPOINT}/ghost"
+core_tester echo "${MNTPOINT}"/ghost check_negative_touch "$TEST_CASE"
+
+TEST_CASE="case 8.2 - stat ${MNTPOINT}/ndir/file then mkdir ${MNTPOINT}/ndir"
+core_tester echo "${MNTPOINT}"/ndir check_negative_mkdir "$TEST_CASE"
+
+TEST_CASE="case 8.3 - remount and stat again"
+core_tester echo "$TEST_CASE" check_remount "$TEST_CASE"
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+TEST_CASE="case 9 - discard"
+
+MARK="NEWFS-DISCARD-MARK"
+
+function check_written () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    touch_and_check "${MNTPOINT}"/victim
+    printf "$_PARAM%.0s" {1..300} > "${MNTPOINT}"/victim
+    umount_and_wait
+    if ! grep -a "$_PARAM" "$HOME"/ddriver > /dev/null; then
+        fail "$_TEST_CASE: umount后ddriver介质中找不到${MNTPOINT}/victim的内容, 请检查数据写回"
+        return 1
+    fi
+    return 0
+}
+
+function check_discarded () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    try_mount_or_fail
+    if ! truncate -s 0 "${MNTPOINT}"/victim; then
+        fail "$_TEST_CASE: truncate ${MNTPOINT}/victim返回值非0"
+        return 1
+    fi
+    umount_and_wait
+    if grep -a "$_PARAM" "$HOME"/ddriver > /dev/null; then
+        fail "$_TEST_CASE: 释放的数据块仍留在ddriver介质中, 请检查是否向设备发出了IOC_REQ_DEVICE_DISCARD"
+        return 1
+    fi
+    if ddriver_stat_line discarded | grep " 0B$" > /dev/null; then
+        fail "$_TEST_CASE: ddriver -s显示没有丢弃任何字节"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 9.1 - write ${MNTPOINT}/victim and umount"
+core_tester echo "$MARK" check_written "$TEST_CASE"
+
+TEST_CASE="case 9.2 - truncate ${MNTPOINT}/victim and umount"
+core_tester echo "$MARK" check_discarded "$TEST_CASE"
@@ -0,0 +1,63 @@
+#!/bin/bash
+
+TEST_CASE="case 10 - flush barrier"
+
+GOLDEN="Lorem ipsum dolor sit amet, consectetur adipisicing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua."
+MARK="NEWFS-FLUSH-MARK"
+
+# 打开ddriver写缓存后挂载, 缓存中的数据只有在IOC_REQ_DEVICE_FLUSH或关闭设备时才落盘
+function mount_with_wcache() {
+    clean_mount
+    (export DDRIVER_WCACHE=64K; mount_fuse)
+    try_mount_or_fail
+}
+
+function check_fsync_crash () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    mount_with_wcache
+    mkdir_and_check "${MNTPOINT}"/dir0
+    echo "$_PARAM" > "${MNTPOINT}"/dir0/durable
+    if ! sync "${MNTPOINT}"/dir0/durable; then
+        fail "$_TEST_CASE: fsync ${MNTPOINT}/dir0/durable返回值非0"
+        return 1
+    fi
+    # 模拟掉电: 进程来不及写回缓存
+    pkill -9 -f -- "--device=$HOME/ddriver"
+    while pgrep -f -- "--device=$HOME/ddriver" > /dev/null; do
+        sleep 0.1
+    done
+    clean_mount
+    try_mount_or_fail
+    OUTPUT=$(cat "${MNTPOINT}"/dir0/durable 2>/dev/null)
+    if [[ "${OUTPUT}" != "$_PARAM" ]]; then
+        fail "$_TEST_CASE: fsync后进程被杀, 重新挂载读出的${MNTPOINT}/dir0/durable内容不正确, 请检查fsync是否发出了IOC_REQ_DEVICE_FLUSH"
+        return 1
+    fi
+    return 0
+}
+
+function check_umount_flush () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    mount_with_wcache
+    echo "$_PARAM" > "${MNTPOINT}"/file0
+    umount_and_wait
+    if ! grep -a "$_PARAM" "$HOME"/ddriver > /dev/null; then
+        fail "$_TEST_CASE: umount后ddriver介质中找不到${MNTPOINT}/file0的内容, 请检查卸载时是否写回了设备缓存"
+        return 1
+    fi
+    if ddriver_stat_line wcache | grep " 0 flushes$" > /dev/null; then
+        fail "$_TEST_CASE: ddriver -s显示写缓存从未被冲刷"
+        return 1
+    fi
+    return 0
+}
+
+TEST_CASE="case 10.1 - fsync ${MNTPOINT}/dir0/durable then kill"
+core_tester echo "$GOLDEN" check_fsync_crash "$TEST_CASE"
+
+TEST_CASE="case 10.2 - write ${MNTPOINT}/file0 then umount"
+core_tester echo "$MARK" check_umount_flush "$TEST_CASE"
+
+clean_mount
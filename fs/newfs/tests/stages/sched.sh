@@ -0,0 +1,70 @@
+#!/bin/bash
+
+TEST_CASE="case 12 - scheduler"
+
+DDRIVER_TOOLS="$ROOT_PATH"/../../../driver/user_ddriver
+TRACE=$(mktemp)
+DISK_SZ=$(numfmt --from=iec "${DDRIVER_DISK_SZ:-4M}")
+
+# 按小端序输出$1的低$2个字节
+function le_bytes() {
+    local v=$1 n=$2 i
+    for ((i = 0; i < n; i++)); do
+        printf "\\x$(printf %02x $(( (v >> (8 * i)) & 255 )))"
+    done
+}
+
+# 以3,2,1,0的逆序提交4个相邻扇区的异步写, 再一次poll收齐, 格式见ddriver_trace.h
+function make_trace() {
+    {
+        le_bytes $((0x52544444)) 4; le_bytes 1 2; le_bytes 24 2
+        le_bytes 512 4; le_bytes 0 4; le_bytes "$DISK_SZ" 8
+        for blk in 3 2 1 0; do
+            le_bytes 0 8; le_bytes $((blk * 512)) 8; le_bytes 512 4; le_bytes 6 1; le_bytes 0 3
+        done
+        le_bytes 0 8; le_bytes 4 8; le_bytes 4 4; le_bytes 7 1; le_bytes 0 3
+    } > "$TRACE"
+}
+
+function replay_with() {
+    ddriver -r > /dev/null 2>&1
+    DDRIVER_SCHED=$1 DDRIVER_IO_SZ=512 "$DDRIVER_TOOLS"/bin/ddriver_replay "$TRACE" > /dev/null 2>&1
+}
+
+function check_fifo () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    replay_with fifo
+    if ! ddriver_stat_line pattern | grep "random 4$" > /dev/null; then
+        fail "$_TEST_CASE: fifo应按提交顺序派发, 4个逆序请求应全部为随机访问"
+        return 1
+    fi
+    return 0
+}
+
+function check_elevator () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    for sched in clook scan deadline; do
+        replay_with $sched
+        if ! ddriver_stat_line pattern | grep "random 0$" > /dev/null; then
+            fail "$_TEST_CASE: $sched应按地址顺序派发, 4个逆序请求应全部为顺序访问"
+            return 1
+        fi
+    done
+    return 0
+}
+
+clean_mount
+if [ ! -x "$DDRIVER_TOOLS"/bin/ddriver_replay ]; then
+    make -s -C "$DDRIVER_TOOLS" tools > /dev/null
+fi
+make_trace
+
+TEST_CASE="case 12.1 - replay reversed writes with fifo"
+core_tester echo "$TEST_CASE" check_fifo "$TEST_CASE"
+
+TEST_CASE="case 12.2 - replay reversed writes with clook/scan/deadline"
+core_tester echo "$TEST_CASE" check_elevator "$TEST_CASE"
+
+rm -f "$TRACE"
@@ -0,0 +1,86 @@
+#!/bin/bash
+
+TEST_CASE="case 11 - stripe"
+
+STRIPES=4
+STRIPE_UNIT=4096
+DISK_SZ=$(numfmt --from=iec "${DDRIVER_DISK_SZ:-4M}")
+
+# 只删除条带成员, ~/ddriver.conf等不能动
+function remove_members() {
+    for ((i = 1; i < STRIPES; i++)); do
+        rm -f "$HOME"/ddriver.$i
+    done
+}
+
+function mount_striped() {
+    clean_mount
+    (export DDRIVER_STRIPES=$STRIPES DDRIVER_STRIPE_UNIT=$STRIPE_UNIT; mount_fuse)
+    try_mount_or_fail
+}
+
+function check_striped_write () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    remove_members
+    mount_striped
+    mkdir_and_check "${MNTPOINT}"/dir0
+    # 6个数据块跨过多个条带单元
+    printf "$_PARAM%.0s" {1..300} > "${MNTPOINT}"/dir0/file0
+    umount_and_wait
+    for ((i = 1; i < STRIPES; i++)); do
+        if [ ! -s "$HOME"/ddriver.$i ]; then
+            fail "$_TEST_CASE: 条带成员$HOME/ddriver.$i不存在或为空"
+            return 1
+        fi
+    done
+    return 0
+}
+
+function check_striped_read () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    mount_striped
+    OUTPUT=$(cat "${MNTPOINT}"/dir0/file0)
+    if [[ "${OUTPUT}" != "$(printf "$_PARAM%.0s" {1..300})" ]]; then
+        fail "$_TEST_CASE: 条带化重新挂载后${MNTPOINT}/dir0/file0内容不正确"
+        return 1
+    fi
+    umount_and_wait
+    return 0
+}
+
+# 第k个条带单元位于成员k%N的(k/N)*unit处, 按此拼回单个镜像后不条带化也应能读出同样的内容
+function check_destriped () {
+    _PARAM=$1
+    _TEST_CASE=$2
+    FLAT="$HOME"/ddriver.flat
+    rm -f "$FLAT"
+    for ((k = 0; k < DISK_SZ / STRIPE_UNIT; k++)); do
+        if ((k % STRIPES == 0)); then
+            SRC="$HOME"/ddriver
+        else
+            SRC="$HOME"/ddriver.$((k % STRIPES))
+        fi
+        dd if="$SRC" of="$FLAT" bs=$STRIPE_UNIT count=1 skip=$((k / STRIPES)) seek=$k \
+            conv=notrunc status=none
+    done
+    mv "$FLAT" "$HOME"/ddriver
+    remove_members
+    try_mount_or_fail
+    OUTPUT=$(cat "${MNTPOINT}"/dir0/file0 2>/dev/null)
+    if [[ "${OUTPUT}" != "$(printf "$_PARAM%.0s" {1..300})" ]]; then
+        fail "$_TEST_CASE: 按条带映射拼回的镜像中${MNTPOINT}/dir0/file0内容不正确, 请检查条带映射"
+        return 1
+    fi
+    return 0
+}
+
+TEST_CASE="case 11.1 - write ${MNTPOINT}/dir0/file0 on $STRIPES stripes"
+core_tester echo "NEWFS-STRIPE-MARK" check_striped_write "$TEST_CASE"
+
+TEST_CASE="case 11.2 - remount $STRIPES stripes and read"
+core_tester echo "NEWFS-STRIPE-MARK" check_striped_read "$TEST_CASE"
+
+TEST_CASE="case 11.3 - destripe and read"
+core_tester echo "NEWFS-STRIPE-MARK" check_destriped "$TEST_CASE"
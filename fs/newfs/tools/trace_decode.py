@@ -0,0 +1,75 @@
+import argparse
+import os
+import struct
+import sys
+
+""" 解码newfs的事件跟踪文件(--trace=<path> 或 NEWFS_TRACE=<path>), 格式见include/types.h """
+
+""" Layout """
+MAGIC = 0x5254464e
+HDR = struct.Struct("<IHHH6x")
+REC = struct.Struct("<QIHHqq24s")
+
+""" Messages """
+ERROR = "错误: "
+
+parser = argparse.ArgumentParser(description="解码newfs的事件跟踪文件")
+parser.add_argument("trace", help="跟踪文件路径")
+parser.add_argument("-e", "--event", action="append", help="只显示该事件(名称前缀, 如alloc, 可多次指定)")
+parser.add_argument("-t", "--tid", type=int, action="append", help="只显示该线程的事件(可多次指定)")
+parser.add_argument("-s", "--stats", action="store_true", help="只输出各事件的计数")
+args = parser.parse_args()
+
+""" Read header and per-event format strings """
+def load(path: str):
+    with open(path, "rb") as f:
+        raw = f.read()
+    if len(raw) < HDR.size:
+        print(ERROR + "%s 太短" % path)
+        sys.exit(1)
+    magic, rec_size, nevents, fmt_len = HDR.unpack_from(raw, 0)
+    if magic != MAGIC or rec_size != REC.size:
+        print(ERROR + "%s 不是newfs跟踪文件" % path)
+        sys.exit(1)
+    off = HDR.size
+    fmts = []
+    for _ in range(nevents):
+        fmts.append(raw[off:off + fmt_len].split(b"\0", 1)[0].decode())
+        off += fmt_len
+    recs = []
+    tail = (len(raw) - off) % rec_size
+    if tail:
+        print("警告: 末尾有%d字节不完整的记录, 已忽略" % tail, file=sys.stderr)
+    for i in range(off, len(raw) - tail, rec_size):
+        ts, tid, event, _, a, b, s = REC.unpack_from(raw, i)
+        recs.append((ts, tid, event, a, b, s.split(b"\0", 1)[0].decode(errors="replace")))
+    # 各线程的环缓冲区分别写出, 按时间戳合并
+    recs.sort(key=lambda r: r[0])
+    return fmts, recs
+
+""" Header entries are "name|format" """
+def name_of(fmts, event: int):
+    return fmts[event].split("|", 1)[0] if event < len(fmts) else "event%d" % event
+
+def render(fmts, event: int, a: int, b: int, s: str):
+    if event >= len(fmts):
+        return "a=%d b=%d s=%s" % (a, b, s)
+    return fmts[event].split("|", 1)[-1].replace("{a}", str(a)).replace("{b}", str(b)).replace("{s}", s)
+
+fmts, recs = load(args.trace)
+if args.event:
+    recs = [r for r in recs if any(name_of(fmts, r[2]).startswith(e) for e in args.event)]
+if args.tid:
+    recs = [r for r in recs if r[1] in args.tid]
+
+if args.stats:
+    counts = {}
+    for r in recs:
+        counts[name_of(fmts, r[2])] = counts.get(name_of(fmts, r[2]), 0) + 1
+    for name, cnt in sorted(counts.items(), key=lambda kv: -kv[1]):
+        print("%-12s %10d" % (name, cnt))
+    sys.exit(0)
+
+t0 = recs[0][0] if recs else 0
+for ts, tid, event, a, b, s in recs:
+    print("%12.6f %7d  %s" % ((ts - t0) / 1e9, tid, render(fmts, event, a, b, s)))
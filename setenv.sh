@@ -22,10 +22,10 @@ function install_driver() {
         if [ "$has_root_permission" -eq 1 ]; then
             if command -v apt-get > /dev/null 2>&1; then
                 echo "> apt install"
-                sudo apt-get install make cmake fuse libfuse-dev
+                sudo apt-get install make cmake fuse libfuse-dev libfuse3-dev
             else 
                 echo "> yum install"
-                sudo yum install make cmake fuse fuse-devel 
+                sudo yum install make cmake fuse fuse-devel fuse3-devel
             fi 
         else
             echo "警告：没有包被安装，如果是校内远程计算节点，请忽略"
@@ -33,10 +33,10 @@ function install_driver() {
     else 
         if command -v apt-get > /dev/null 2>&1; then
             echo "> apt install"
-            sudo apt-get install make cmake fuse libfuse-dev
+            sudo apt-get install make cmake fuse libfuse-dev libfuse3-dev
         else 
             echo "> yum install"
-            sudo yum install make cmake fuse fuse-devel 
+            sudo yum install make cmake fuse fuse-devel fuse3-devel
         fi
     fi
     